@@ -0,0 +1,300 @@
+#include "bench.hpp"
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <common/big_integer.hpp>
+#include <common/command.hpp>
+#include <common/flags.hpp>
+#include <common/output_writer.hpp>
+#include <common/thread_pool.hpp>
+#include <task6/merge_sort.hpp>
+#include <task6/sort.hpp>
+
+namespace {
+
+using Integer = big_numbers::BigInteger;
+using ThreadPool = thread_pool::ThreadPool<std::function<void()>>;
+
+// Every input is generated from a fixed seed, so runs are comparable
+constexpr uint64_t kSeed = 42;
+
+std::vector<size_t> Sizes(std::initializer_list<size_t> sizes, size_t max) {
+  std::vector<size_t> res;
+  for (size_t size : sizes) {
+    if (size <= max) {
+      res.push_back(size);
+    }
+  }
+  return res;
+}
+
+Integer RandomInteger(size_t limbs, std::mt19937_64 &rng) {
+  std::string digits(limbs * Integer::kWidth, '0');
+  for (auto &digit : digits) {
+    digit = '0' + rng() % 10;
+  }
+  digits[0] = '1' + rng() % 9;
+  return Integer(digits);
+}
+
+void BigIntegerBenchmarks(bench::Runner &runner, size_t max_limbs,
+                          size_t max_mul_limbs) {
+  std::mt19937_64 rng(kSeed);
+
+  for (size_t limbs : Sizes({1, 10, 100, 1000, 10000, 100000, 1000000}, max_limbs)) {
+    auto name = std::to_string(limbs);
+    if (!runner.Enabled("bigint/add/" + name) &&
+        !runner.Enabled("bigint/to_string/" + name)) {
+      continue;
+    }
+    Integer a = RandomInteger(limbs, rng);
+    Integer b = RandomInteger(limbs, rng);
+
+    runner.Run("bigint/add/" + name, [&](size_t iterations) {
+      for (size_t i = 0; i < iterations; ++i) {
+        bench::DoNotOptimize(a + b);
+      }
+    });
+    runner.Run("bigint/to_string/" + name, [&](size_t iterations) {
+      for (size_t i = 0; i < iterations; ++i) {
+        bench::DoNotOptimize(a.ToString());
+      }
+    });
+  }
+
+  // Schoolbook multiplication is quadratic
+  for (size_t limbs : Sizes({1, 10, 100, 1000, 10000, 100000, 1000000},
+                            std::min(max_limbs, max_mul_limbs))) {
+    Integer a = RandomInteger(limbs, rng);
+    Integer b = RandomInteger(limbs, rng);
+    runner.Run("bigint/mul/" + std::to_string(limbs), [&](size_t iterations) {
+      for (size_t i = 0; i < iterations; ++i) {
+        bench::DoNotOptimize(a * b);
+      }
+    });
+  }
+
+  // Division subtracts the divisor once per unit of every quotient limb, so
+  // a random quotient would take ~1e16 steps: quotient limbs are kept below
+  // 10, the dividend has twice the limbs of the divisor
+  for (size_t limbs : Sizes({1, 4, 16, 64}, max_limbs)) {
+    Integer divisor = RandomInteger(limbs, rng);
+    std::string quotient(limbs * Integer::kWidth, '0');
+    for (size_t i = Integer::kWidth - 1; i < quotient.size(); i += Integer::kWidth) {
+      quotient[i] = '1' + rng() % 9;
+    }
+    Integer dividend = divisor * Integer(quotient) + Integer(static_cast<int>(rng() % 1000));
+    runner.Run("bigint/div/" + std::to_string(limbs), [&](size_t iterations) {
+      for (size_t i = 0; i < iterations; ++i) {
+        bench::DoNotOptimize(dividend / divisor);
+      }
+    });
+  }
+
+  // Same loop as task5. Every row of the product is a shifted copy, so
+  // even multiplying by one limb is quadratic in the left operand.
+  for (uint32_t n : {100u, 500u, 1000u, 2000u}) {
+    runner.Run("factorial/" + std::to_string(n), [&](size_t iterations) {
+      for (size_t i = 0; i < iterations; ++i) {
+        Integer res{1};
+        for (uint32_t cur = 2; cur <= n; ++cur) {
+          res *= cur;
+        }
+        bench::DoNotOptimize(res);
+      }
+    });
+  }
+}
+
+void ThreadPoolBenchmarks(bench::Runner &runner) {
+  for (size_t threads : {1, 2, 4, 8}) {
+    auto name = std::to_string(threads);
+    if (!runner.Enabled("thread_pool/submit/" + name) &&
+        !runner.Enabled("thread_pool/submit_batch/" + name) &&
+        !runner.Enabled("thread_pool/latency/" + name)) {
+      continue;
+    }
+    ThreadPool pool(threads, thread_pool::OverflowPolicy::kAllow);
+    std::atomic<size_t> done{0};
+
+    // Submission and execution of empty tasks one by one
+    runner.Run("thread_pool/submit/" + name, [&](size_t iterations) {
+      for (size_t i = 0; i < iterations; ++i) {
+        pool.AddTask([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+      }
+      pool.WaitForIdle();
+    });
+
+    // The same tasks in batches of 256 through AddTasks
+    runner.Run("thread_pool/submit_batch/" + name, [&](size_t iterations) {
+      std::vector<std::function<void()>> batch;
+      for (size_t i = 0; i < iterations; i += batch.size()) {
+        batch.assign(std::min<size_t>(256, iterations - i),
+                     [&done] { done.fetch_add(1, std::memory_order_relaxed); });
+        pool.AddTasks(batch.begin(), batch.end());
+      }
+      pool.WaitForIdle();
+    });
+
+    // Time from AddTask until a worker starts the task, tasks go one at a
+    // time into an idle pool
+    if (runner.Enabled("thread_pool/latency/" + name)) {
+      constexpr size_t kTasks = 20000;
+      std::vector<double> latency;
+      latency.reserve(kTasks);
+      for (size_t i = 0; i < kTasks; ++i) {
+        bench::Clock::time_point started;
+        auto submitted = bench::Clock::now();
+        pool.AddTask([&started] { started = bench::Clock::now(); })->Wait();
+        latency.push_back(
+            std::chrono::duration<double, std::nano>(started - submitted).count());
+      }
+      std::sort(latency.begin(), latency.end());
+      runner.Report("thread_pool/latency/" + name,
+                    {{"ns_per_op", latency[kTasks / 2]},
+                     {"p90_ns", latency[kTasks * 9 / 10]},
+                     {"p99_ns", latency[kTasks * 99 / 100]},
+                     {"max_ns", latency.back()}});
+    }
+  }
+}
+
+void LauncherBenchmarks(bench::Runner &runner) {
+  // Reports go to /dev/null through a writer instead of std::cout
+  int null_fd = ::open("/dev/null", O_WRONLY | O_CLOEXEC);
+  data::OutputWriter writer(null_fd, data::OutputOrder::kCompletion);
+  data::CommandLauncher::SetWriter(&writer);
+
+  std::pair<const char *, data::LaunchBackend> backends[] = {
+      {"popen", data::LaunchBackend::kPopen},
+      {"spawn", data::LaunchBackend::kSpawn}};
+  for (auto [backend_name, backend] : backends) {
+    data::CommandLauncher::SetBackend(backend);
+    auto launch = [] {
+      data::CommandLauncher(std::make_unique<data::Command>("true"))();
+    };
+
+    runner.Run(std::string("launcher/spawn/") + backend_name,
+               [&](size_t iterations) {
+                 for (size_t i = 0; i < iterations; ++i) {
+                   launch();
+                 }
+               });
+
+    // Launchers from 4 workers at once
+    auto name = std::string("launcher/spawn_parallel/") + backend_name;
+    if (runner.Enabled(name)) {
+      ThreadPool pool(4, thread_pool::OverflowPolicy::kAllow);
+      runner.Run(name, [&](size_t iterations) {
+        for (size_t i = 0; i < iterations; ++i) {
+          pool.AddTask(launch);
+        }
+        pool.WaitForIdle();
+      });
+    }
+  }
+
+  data::CommandLauncher::SetBackend(data::LaunchBackend::kSpawn);
+  data::CommandLauncher::SetWriter(nullptr);
+  ::close(null_fd);
+}
+
+template <class T>
+std::vector<T> Distribution(const std::string &name, size_t size,
+                            std::mt19937_64 &rng) {
+  std::vector<T> data(size);
+  for (auto &value : data) {
+    value = static_cast<T>(static_cast<int64_t>(rng() % (1ull << 40)) - (1ll << 39));
+  }
+  if (name == "sorted" || name == "reversed") {
+    std::sort(data.begin(), data.end());
+  }
+  if (name == "reversed") {
+    std::reverse(data.begin(), data.end());
+  }
+  if (name == "few_unique") {
+    for (auto &value : data) {
+      value = static_cast<T>(rng() % 16);
+    }
+  }
+  if (name == "nearly_sorted") {
+    std::sort(data.begin(), data.end());
+    for (size_t i = 0; i < size / 100; ++i) {
+      std::swap(data[rng() % size], data[rng() % size]);
+    }
+  }
+  return data;
+}
+
+template <class T>
+void SortBenchmarks(bench::Runner &runner, const std::string &type,
+                    size_t max_size, sort::impl::ThreadPool &pool) {
+  std::mt19937_64 rng(kSeed);
+  for (std::string dist : {"random", "sorted", "reversed", "nearly_sorted", "few_unique"}) {
+    for (size_t size : Sizes({1000, 100000, 1000000, 10000000}, max_size)) {
+      auto suffix = "/" + type + "/" + dist + "/" + std::to_string(size);
+      if (!runner.Enabled("sort/std_sort" + suffix) &&
+          !runner.Enabled("sort/merge_sort" + suffix) &&
+          !runner.Enabled("sort/sort" + suffix)) {
+        continue;
+      }
+      auto input = Distribution<T>(dist, size, rng);
+      std::vector<T> data;
+      auto reset = [&] { data = input; };
+      auto items = bench::Metrics{{"items", static_cast<double>(size)}};
+
+      runner.RunWithSetup("sort/std_sort" + suffix, reset, [&] {
+        std::sort(data.begin(), data.end(), std::less<T>{});
+      }, items);
+      runner.RunWithSetup("sort/merge_sort" + suffix, reset, [&] {
+        sort::MergeSort(data.begin(), data.end(), std::less<T>{}, pool);
+      }, items);
+      runner.RunWithSetup("sort/sort" + suffix, reset, [&] {
+        sort::Sort(data.begin(), data.end(), std::less<T>{}, pool);
+      }, items);
+    }
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  cli::Flags flags(argc, argv);
+
+  bench::Options options;
+  options.filter = flags.Get("filter").value_or("");
+  options.min_time = std::chrono::milliseconds(flags.GetNumber("min-time", 100));
+  options.repetitions = std::max<size_t>(flags.GetNumber("repetitions", 5), 1);
+  bench::Runner runner(options);
+
+  // --max-limbs=N, --max-mul-limbs=N and --max-sort=N cap the input sizes
+  BigIntegerBenchmarks(runner, flags.GetNumber("max-limbs", 1000000),
+                       flags.GetNumber("max-mul-limbs", 1000));
+  ThreadPoolBenchmarks(runner);
+  LauncherBenchmarks(runner);
+
+  size_t threads = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+  sort::impl::ThreadPool pool(threads - 1, thread_pool::OverflowPolicy::kAllow);
+  size_t max_sort = flags.GetNumber("max-sort", 1000000);
+  SortBenchmarks<int32_t>(runner, "int32", max_sort, pool);
+  SortBenchmarks<double>(runner, "double", max_sort, pool);
+
+  // --out=PATH, "-" is stdout
+  auto out = flags.Get("out").value_or("bench_output.json");
+  if (out == "-") {
+    runner.WriteJson(std::cout);
+  } else {
+    std::ofstream file(out);
+    runner.WriteJson(file);
+    std::cerr << "results written to " << out << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace bench {
+
+using Clock = std::chrono::steady_clock;
+using Metrics = std::vector<std::pair<std::string, double>>;
+
+// Keeps the compiler from dropping a computation whose result is unused
+template <class T>
+void DoNotOptimize(const T &value) {
+  asm volatile("" : : "r"(&value) : "memory");
+}
+
+struct Options {
+  // Only benchmarks whose name contains the filter are run
+  std::string filter;
+  // Every sample runs the operation at least this long
+  std::chrono::milliseconds min_time{100};
+  size_t repetitions{5};
+};
+
+// Every benchmark reports ns_per_op, the median over the samples, which is
+// what runs are compared by. The other metrics are informational.
+struct Result {
+  std::string name;
+  Metrics metrics;
+};
+
+class Runner {
+public:
+  explicit Runner(const Options &options) : options_(options) {}
+
+  bool Enabled(const std::string &name) const {
+    return name.find(options_.filter) != std::string::npos;
+  }
+
+  // `op(iterations)` runs the operation that many times. The count is
+  // calibrated so that a sample takes at least min_time.
+  template <class Op>
+  void Run(const std::string &name, Op op, Metrics extra = {}) {
+    if (!Enabled(name)) {
+      return;
+    }
+    Measure(name, [&](size_t iterations) {
+      auto start = Clock::now();
+      op(iterations);
+      return Clock::now() - start;
+    }, std::move(extra));
+  }
+
+  // `setup()` runs before every `op()` and is not timed
+  template <class Setup, class Op>
+  void RunWithSetup(const std::string &name, Setup setup, Op op,
+                    Metrics extra = {}) {
+    if (!Enabled(name)) {
+      return;
+    }
+    Measure(name, [&](size_t iterations) {
+      Clock::duration total{};
+      for (size_t i = 0; i < iterations; ++i) {
+        setup();
+        auto start = Clock::now();
+        op();
+        total += Clock::now() - start;
+      }
+      return total;
+    }, std::move(extra));
+  }
+
+  // Results of benchmarks which measure themselves
+  void Report(const std::string &name, Metrics metrics) {
+    Print(name, metrics);
+    results_.push_back(Result{name, std::move(metrics)});
+  }
+
+  void WriteJson(std::ostream &out) const {
+    out << std::setprecision(17);
+    out << "{\n  \"context\": {\"time\": " << std::time(nullptr)
+        << ", \"threads\": " << std::thread::hardware_concurrency()
+        << ", \"compiler\": \"" << __VERSION__ << "\""
+        << ", \"min_time_ms\": " << options_.min_time.count()
+        << ", \"repetitions\": " << options_.repetitions << "},\n"
+        << "  \"benchmarks\": [";
+    for (size_t i = 0; i < results_.size(); ++i) {
+      out << (i ? ",\n" : "\n") << "    {\"name\": \"" << results_[i].name
+          << "\", \"metrics\": {";
+      for (size_t j = 0; j < results_[i].metrics.size(); ++j) {
+        auto &[key, value] = results_[i].metrics[j];
+        out << (j ? ", " : "") << "\"" << key << "\": " << value;
+      }
+      out << "}}";
+    }
+    out << "\n  ]\n}\n";
+  }
+
+private:
+  using Sample = std::function<Clock::duration(size_t)>;
+
+  void Measure(const std::string &name, const Sample &sample, Metrics extra) {
+    size_t iterations = 1;
+    while (true) {
+      auto elapsed = sample(iterations);
+      if (elapsed >= options_.min_time) {
+        break;
+      }
+      // Aim a bit past min_time, but grow at most 10x per step
+      double ratio = elapsed.count() > 0
+                         ? 1.2 * options_.min_time / elapsed
+                         : 10.0;
+      iterations = std::max(iterations + 1,
+                            static_cast<size_t>(iterations * std::min(ratio, 10.0)));
+    }
+
+    std::vector<double> ns;
+    for (size_t i = 0; i < options_.repetitions; ++i) {
+      auto elapsed = std::chrono::duration<double, std::nano>(sample(iterations));
+      ns.push_back(elapsed.count() / iterations);
+    }
+    std::sort(ns.begin(), ns.end());
+
+    Metrics metrics{{"ns_per_op", ns[ns.size() / 2]},
+                    {"min_ns_per_op", ns.front()},
+                    {"max_ns_per_op", ns.back()},
+                    {"iterations", static_cast<double>(iterations)}};
+    metrics.insert(metrics.end(), extra.begin(), extra.end());
+    Report(name, std::move(metrics));
+  }
+
+  static void Print(const std::string &name, const Metrics &metrics) {
+    std::cout << std::left << std::setw(48) << name;
+    for (auto &[key, value] : metrics) {
+      std::cout << " " << key << "=" << value;
+    }
+    std::cout << std::endl;
+  }
+
+  Options options_;
+  std::vector<Result> results_;
+};
+
+} // namespace bench
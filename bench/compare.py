@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Compares ns_per_op of two benchmark runs written by ./bench.
+
+Exits with 1 if any benchmark got slower than the threshold allows.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as file:
+        data = json.load(file)
+    return {item["name"]: item["metrics"] for item in data["benchmarks"]}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("base", help="results of the baseline run")
+    parser.add_argument("new", help="results of the run to check")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="relative slowdown reported as a regression")
+    parser.add_argument("--metric", default="ns_per_op",
+                        help="metric to compare, lower is better")
+    args = parser.parse_args()
+
+    base = load(args.base)
+    new = load(args.new)
+
+    regressions = 0
+    print(f"{'benchmark':<48} {'base':>14} {'new':>14} {'change':>8}")
+    for name in sorted(base.keys() & new.keys()):
+        old_value = base[name].get(args.metric)
+        new_value = new[name].get(args.metric)
+        if not old_value or new_value is None:
+            continue
+
+        change = new_value / old_value - 1
+        mark = ""
+        if change > args.threshold:
+            mark = "  REGRESSION"
+            regressions += 1
+        elif change < -args.threshold:
+            mark = "  improved"
+        print(f"{name:<48} {old_value:>14.1f} {new_value:>14.1f} "
+              f"{change:>+8.1%}{mark}")
+
+    for name in sorted(base.keys() - new.keys()):
+        print(f"{name:<48} missing in the new run")
+    for name in sorted(new.keys() - base.keys()):
+        print(f"{name:<48} new")
+
+    if regressions:
+        print(f"{regressions} regression(s) above {args.threshold:.0%}")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
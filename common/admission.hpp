@@ -0,0 +1,264 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+namespace thread_pool {
+
+// Spawn rate limit: `rate` tokens per second, at most `burst` saved up.
+// Zero rate means no limit.
+class TokenBucket {
+public:
+  TokenBucket(double rate, double burst)
+      : rate_(rate), burst_(std::max(burst, 1.0)), tokens_(burst_),
+        last_(Clock::now()) {}
+
+  // Takes up to `count` tokens, returns how many were taken
+  size_t Take(size_t count, Clock::time_point now) {
+    if (rate_ <= 0) {
+      return count;
+    }
+    Refill(now);
+    size_t taken = std::min<size_t>(count, tokens_);
+    tokens_ -= taken;
+    return taken;
+  }
+
+  void Return(size_t count) {
+    if (rate_ > 0) {
+      tokens_ = std::min(burst_, tokens_ + count);
+    }
+  }
+
+  // When the next whole token is available
+  Clock::time_point NextToken(Clock::time_point now) {
+    if (rate_ <= 0) {
+      return now;
+    }
+    Refill(now);
+    double missing = std::max(0.0, 1 - tokens_);
+    return now + std::chrono::duration_cast<Clock::duration>(
+                     std::chrono::duration<double>(missing / rate_));
+  }
+
+private:
+  void Refill(Clock::time_point now) {
+    tokens_ = std::min(
+        burst_, tokens_ + std::chrono::duration<double>(now - last_).count() * rate_);
+    last_ = now;
+  }
+
+  const double rate_;
+  const double burst_;
+  double tokens_;
+  Clock::time_point last_;
+};
+
+// Zero max_wait means pending tasks wait as long as it takes
+struct AdmissionOptions {
+  size_t queue_capacity{0};
+  std::chrono::milliseconds max_wait{0};
+  double rate{0};
+  double burst{1};
+};
+
+struct AdmissionStats {
+  size_t admitted{0};
+  size_t queued{0};
+  size_t queued_max{0};
+  size_t rejected_full{0};
+  size_t rejected_expired{0};
+};
+
+inline std::ostream& operator<<(std::ostream& out, const AdmissionStats& stats) {
+  return out << "admission: admitted=" << stats.admitted
+             << " queued=" << stats.queued
+             << " queued_max=" << stats.queued_max
+             << " rejected_full=" << stats.rejected_full
+             << " rejected_expired=" << stats.rejected_expired;
+}
+
+// Front of a kReject pool. Tasks which do not fit into idle workers or the
+// rate limit wait in a bounded FIFO for up to max_wait; only tasks beyond
+// the capacity or past their wait are rejected. A dispatcher thread moves
+// pending tasks into the pool as workers free up and tokens refill.
+template <typename Callable>
+class AdmissionController {
+public:
+  enum class Rejection { kQueueFull, kExpired };
+
+  // Called without locks held, the task is destroyed right after
+  using OnReject = std::function<void(Callable&, Rejection)>;
+
+  AdmissionController(ThreadPool<Callable>& pool,
+                      const AdmissionOptions& options, OnReject on_reject)
+      : pool_(pool), options_(options), on_reject_(std::move(on_reject)),
+        bucket_(options.rate, options.burst),
+        thread_(&AdmissionController::Run, this) {}
+
+  // Pending tasks are still admitted or expire
+  ~AdmissionController() {
+    {
+      std::unique_lock lock(mt_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  // Callables are moved out of [first, last)
+  template <typename It>
+  void Submit(It first, It last) {
+    std::vector<Callable> rejected;
+    {
+      std::unique_lock lock(mt_);
+      // Nothing may overtake tasks which are already waiting
+      if (pending_.empty()) {
+        first = Admit(first, last, Clock::now());
+      }
+
+      auto deadline = options_.max_wait.count() > 0
+                          ? Clock::now() + options_.max_wait
+                          : Clock::time_point::max();
+      for (; first != last; ++first) {
+        if (pending_.size() >= options_.queue_capacity) {
+          rejected.push_back(std::move(*first));
+          continue;
+        }
+        pending_.push_back(Pending{std::move(*first), deadline});
+        ++stats_.queued;
+      }
+      stats_.queued_max = std::max(stats_.queued_max, pending_.size());
+      stats_.rejected_full += rejected.size();
+    }
+    cv_.notify_one();
+
+    for (auto& task : rejected) {
+      on_reject_(task, Rejection::kQueueFull);
+    }
+  }
+
+  // Waits until every pending task is either admitted or rejected
+  void Drain() {
+    std::unique_lock lock(mt_);
+    drained_cv_.wait(lock, [this] { return pending_.empty(); });
+  }
+
+  AdmissionStats GetStats() const {
+    std::unique_lock lock(mt_);
+    return stats_;
+  }
+
+private:
+  struct Pending {
+    Callable task;
+    Clock::time_point deadline;
+  };
+
+  // Gives the pool as much of [first, last) as the rate and idle workers
+  // allow, returns the first task not taken
+  template <typename It>
+  It Admit(It first, It last, Clock::time_point now) {
+    size_t tokens = bucket_.Take(std::distance(first, last), now);
+    if (tokens == 0) {
+      return first;
+    }
+
+    auto group = pool_.AddTasks(first, std::next(first, tokens));
+    size_t accepted = group ? group->Size() : 0;
+    bucket_.Return(tokens - accepted);
+    stats_.admitted += accepted;
+    return std::next(first, accepted);
+  }
+
+  void Run() {
+    std::unique_lock lock(mt_);
+    while (!stop_ || !pending_.empty()) {
+      if (pending_.empty()) {
+        drained_cv_.notify_all();
+        cv_.wait(lock, [this] { return stop_ || !pending_.empty(); });
+        continue;
+      }
+
+      auto now = Clock::now();
+      Expire(lock, now);
+      if (pending_.empty()) {
+        continue;
+      }
+
+      // Pending tasks are taken from the front only, so they are admitted in
+      // the order of submission
+      std::vector<Callable> batch;
+      auto next_token = bucket_.NextToken(now);
+      if (next_token <= now && pool_.HasCapacity()) {
+        batch.push_back(std::move(pending_.front().task));
+        auto rest = Admit(batch.begin(), batch.end(), now);
+        if (rest == batch.begin()) {
+          pending_.front().task = std::move(batch.front());
+        } else {
+          pending_.pop_front();
+          continue;
+        }
+      }
+
+      auto until = std::min(pending_.front().deadline, now + kMaxSleep);
+      if (next_token > now) {
+        cv_.wait_until(lock, std::min(until, next_token));
+        continue;
+      }
+
+      lock.unlock();
+      pool_.WaitForCapacity(until);
+      lock.lock();
+    }
+    drained_cv_.notify_all();
+  }
+
+  void Expire(std::unique_lock<std::mutex>& lock, Clock::time_point now) {
+    std::vector<Callable> expired;
+    while (!pending_.empty() && pending_.front().deadline <= now) {
+      expired.push_back(std::move(pending_.front().task));
+      pending_.pop_front();
+    }
+    if (expired.empty()) {
+      return;
+    }
+
+    stats_.rejected_expired += expired.size();
+    lock.unlock();
+    for (auto& task : expired) {
+      on_reject_(task, Rejection::kExpired);
+    }
+    expired.clear();
+    lock.lock();
+  }
+
+  // Also bounds the wait for a wakeup which was missed
+  static constexpr auto kMaxSleep = std::chrono::milliseconds(100);
+
+  ThreadPool<Callable>& pool_;
+  const AdmissionOptions options_;
+  const OnReject on_reject_;
+
+  mutable std::mutex mt_;
+  std::condition_variable cv_;
+  std::condition_variable drained_cv_;
+  bool stop_{false};
+  TokenBucket bucket_;
+  std::deque<Pending> pending_;
+  AdmissionStats stats_;
+
+  std::thread thread_;
+};
+
+} // namespace thread_pool
@@ -1,4 +1,5 @@
 #include "big_integer.hpp"
+#include "trace.hpp"
 #include <iomanip>
 #include <sstream>
 #include <cctype>
@@ -11,6 +12,9 @@ namespace {
 using CellType = BigInteger::CellType;
 using ContainerType = BigInteger::ContainerType;
 
+// Smaller products are too many and too short to be worth a trace event
+constexpr std::size_t kTracedMultiply = 1 << 8;
+
 CellType SumTwoCells(CellType lhs, CellType rhs, CellType& carry) {
     CellType result = (lhs + rhs) % BigInteger::kModule;
     carry += result < std::max(lhs, rhs);
@@ -335,6 +339,8 @@ BigInteger& BigInteger::operator*=(const BigInteger& other) {
 }
 
 BigInteger BigInteger::operator*(const BigInteger& other) const {
+    [[maybe_unused]] std::size_t products = container_.size() * other.container_.size();
+    TRACE_SCOPE_IF(products >= kTracedMultiply, "bigint_mul", products);
     BigInteger res;
     res.sign_ = this->sign_ * other.sign_;
     std::size_t shift = 0;
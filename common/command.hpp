@@ -1,21 +1,54 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <exception>
+#include <future>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <sstream>
 #include <string>
 
 #include <ctime>
 #include <unistd.h>
 
+#include "command_stats.hpp"
+#include "output_writer.hpp"
+#include "reactor.hpp"
+#include "result_cache.hpp"
+#include "spawn.hpp"
+#include "stream.hpp"
+#include "trace.hpp"
+#include "watchdog.hpp"
+#include "zygote.hpp"
+
 namespace data {
 
 static constexpr size_t kMaxArgs = 10;
 
+using SteadyClock = std::chrono::steady_clock;
+
 static time_t GetTime() {
   return std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
 }
 
+// Same as ctime, but without the buffer shared by all threads
+static std::string TimeString(time_t time) {
+  char buffer[32];
+  return ctime_r(&time, buffer);
+}
+
+enum class LaunchBackend {
+  // popen: fork of the whole process and `/bin/sh -c` for every command
+  kPopen,
+  // posix_spawn, simple commands are executed without shell
+  kSpawn,
+  // posix_spawn in the helper process set with SetZygote
+  kZygote
+};
+
 struct Command {
   Command(const std::string &cmd) : cmd(cmd){};
   Command(const Command &other) = default;
@@ -23,35 +56,331 @@ struct Command {
   std::string cmd{};
 };
 
+// Tasks are numbered in the order launchers are created, i.e. submitted
 class CommandLauncher {
 public:
-  CommandLauncher(std::unique_ptr<Command> &&ptr) : item_ptr_(std::move(ptr)) {}
+  CommandLauncher(std::unique_ptr<Command> &&ptr)
+      : item_ptr_(std::move(ptr)), task_num_(counter++),
+        created_(SteadyClock::now()) {}
   CommandLauncher(CommandLauncher&&) = default;
   CommandLauncher() = default;
-  CommandLauncher &operator=(CommandLauncher &&) = default;
+
+  CommandLauncher &operator=(CommandLauncher &&other) {
+    Skip();
+    item_ptr_ = std::move(other.item_ptr_);
+    task_num_ = other.task_num_;
+    created_ = other.created_;
+    return *this;
+  }
+
+  ~CommandLauncher() { Skip(); }
+
+  static void SetBackend(LaunchBackend backend) { backend_.store(backend); }
+
+  // Helper for LaunchBackend::kZygote. Has to outlive all launchers.
+  static void SetZygote(Zygote *zygote) { zygote_.store(zygote); }
+
+  // Commands running longer than the watchdog's timeout are killed together
+  // with their children. Has to outlive all launchers.
+  static void SetWatchdog(Watchdog *watchdog) { watchdog_.store(watchdog); }
+
+  // With a reactor the launcher only spawns the command and returns, the
+  // output is collected and reported by the reactor thread.
+  static void SetReactor(Reactor *reactor) { reactor_.store(reactor); }
+
+  // Has to be set before any command is launched
+  static void SetOutput(const OutputOptions &options) { output_ = options; }
+
+  // With a writer every task reports all its lines as one record instead of
+  // writing to std::cout. Has to outlive all launchers.
+  static void SetWriter(OutputWriter *writer) { writer_.store(writer); }
+
+  // Every finished command is reported there. Has to outlive all launchers.
+  static void SetStats(StatsReporter *stats) { stats_.store(stats); }
+
+  // Results of captured commands are looked up there before spawning and
+  // stored after. Streaming modes bypass it, the output is not kept.
+  static void SetResultCache(ResultCache *cache) { cache_.store(cache); }
 
   void operator()() {
-    size_t task_num = counter++;
+    TRACE_SCOPE("command");
+    auto command = std::move(item_ptr_);
+    auto start = SteadyClock::now();
+
+    CommandStats stats;
+    stats.task_num = task_num_;
+    stats.queue_ms = ToMs(start - created_);
+    if (stats_.load()) {
+      stats.cmd = command->cmd;
+    }
+
     auto time = GetTime();
-    std::cout << "Task " << task_num << " started at " << ctime(&time)
-              << std::endl;
+    std::ostringstream started;
+    started << "Task " << stats.task_num << " started at " << TimeString(time)
+            << "\n";
+    if (!writer_.load()) {
+      std::cout << started.str();
+      std::cout.flush();
+    }
 
-    int status = -1;
-    std::cout << execCommand(item_ptr_->cmd, status);
+    ResultCache *cache =
+        output_.mode == OutputMode::kCapture ? cache_.load() : nullptr;
+    uint64_t key = cache ? cache->Key(command->cmd) : 0;
+    if (cache && Cached(*cache, key, command->cmd, stats, started.str())) {
+      return;
+    }
 
-    time = GetTime();
-    std::cout << "Task " << task_num << " finished with status " << status
-              << "at " << ctime(&time) << std::endl;
-    std::cout.flush();
+    // A command which cannot be launched is reported as failed like any
+    // other: the ordered writer waits for every task number, and commands
+    // coalesced with this one wait for its result
+    auto fail = [&](const std::exception &error) {
+      std::cerr << "Task " << stats.task_num << " failed to launch: "
+                << error.what() << std::endl;
+      if (cache) {
+        cache->Abandon(key, command->cmd, {{}, -1});
+      }
+      stats.status = -1;
+      Finish(stats, started.str(), {});
+    };
+
+    if (Reactor *reactor = reactor_.load()) {
+      ChildProcess child;
+      try {
+        child = Spawn(command->cmd);
+      } catch (const std::exception &error) {
+        fail(error);
+        return;
+      }
+      auto spawned = SteadyClock::now();
+      stats.spawn_ms = ToMs(spawned - start);
+      auto watch = Watch(child.pid);
+
+      // Called once the child is reaped, not when its stdout is closed
+      reactor->Watch(child,
+                     [stats, spawned, started = started.str(), cache, key,
+                      cmd = command->cmd, watch](std::string output, int rc,
+                                                 const rusage &usage) mutable {
+                       Release(watch);
+                       stats.run_ms = ToMs(SteadyClock::now() - spawned);
+                       SetExit(stats, rc);
+                       stats.SetUsage(usage);
+                       if (cache) {
+                         Complete(*cache, key, cmd, stats, output);
+                       }
+                       Finish(stats, started, output);
+                     },
+                     MakePump());
+      return;
+    }
+
+    std::string output;
+    try {
+      output = execCommand(command->cmd, stats);
+    } catch (const std::exception &error) {
+      fail(error);
+      return;
+    }
+    if (cache) {
+      Complete(*cache, key, command->cmd, stats, output);
+    }
+    Finish(stats, started.str(), output);
   }
 
 private:
-  std::string execCommand(const std::string cmd, int &out_exitStatus) {
-    out_exitStatus = 0;
+  // In streaming modes the output was already written, `output` is the tail
+  // (empty for kStream)
+  static void Finish(const CommandStats &stats, const std::string &started,
+                     const std::string &output) {
+    if (StatsReporter *reporter = stats_.load()) {
+      reporter->Add(stats);
+    }
+
+    size_t task_num = stats.task_num;
+    auto time = GetTime();
+    std::ostringstream record;
+    if (output_.mode == OutputMode::kCapture) {
+      record << output;
+    } else if (!output.empty()) {
+      // Streams of concurrent commands interleave, the tail next to the
+      // status tells how this one ended
+      record << "Task " << task_num << " output tail:\n" << output;
+      if (output.back() != '\n') {
+        record << "\n";
+      }
+    }
+    record << "Task " << task_num << " finished with status " << stats.status
+           << "at " << TimeString(time) << "\n";
+
+    if (OutputWriter *writer = writer_.load()) {
+      writer->Submit(task_num, started + record.str());
+      return;
+    }
+
+    std::cout << record.str();
+    std::cout.flush();
+  }
+
+  // Returns true if the command was served from the cache or attached to
+  // the same command in flight. Otherwise the caller has to run it and
+  // complete the cache entry.
+  static bool Cached(ResultCache &cache, uint64_t key, const std::string &cmd,
+                     CommandStats stats, const std::string &started) {
+    stats.cached = true;
+    auto done = [stats, started](const CachedResult &result) mutable {
+      stats.status = result.status;
+      Finish(stats, started, result.output);
+    };
+
+    if (auto result = cache.Lookup(key, cmd)) {
+      done(*result);
+      return true;
+    }
+
+    // Reactor threads report the coalesced commands along with the leader,
+    // pool threads wait for it as they would for their own child
+    if (reactor_.load()) {
+      return !cache.Acquire(key, cmd, done);
+    }
+
+    std::promise<CachedResult> promise;
+    if (cache.Acquire(key, cmd, [&promise](const CachedResult &result) {
+          promise.set_value(result);
+        })) {
+      return false;
+    }
+    done(promise.get_future().get());
+    return true;
+  }
+
+  // Launcher which was never run (e.g. rejected by the pool) still has to
+  // free its number, otherwise the ordered writer would wait for it forever
+  void Skip() {
+    if (item_ptr_) {
+      item_ptr_.reset();
+      if (OutputWriter *writer = writer_.load()) {
+        writer->Submit(task_num_, {});
+      }
+    }
+  }
+
+  static ChildProcess Spawn(const std::string &cmd) {
+    TRACE_SCOPE("spawn");
+    bool own_group = watchdog_.load() != nullptr;
+    if (backend_.load() == LaunchBackend::kZygote) {
+      return zygote_.load()->Spawn(cmd, own_group);
+    }
+    return SpawnCommand(cmd, own_group);
+  }
+
+  static std::optional<uint64_t> Watch(pid_t pid) {
+    if (Watchdog *watchdog = watchdog_.load()) {
+      return watchdog->Watch(pid);
+    }
+    return std::nullopt;
+  }
+
+  static void Release(std::optional<uint64_t> watch) {
+    if (watch) {
+      watchdog_.load()->Release(*watch);
+    }
+  }
+
+  static int Wait(pid_t pid, rusage *usage) {
+    TRACE_SCOPE("wait_child");
+    if (backend_.load() == LaunchBackend::kZygote) {
+      return zygote_.load()->Wait(pid, usage);
+    }
+    return WaitChild(pid, usage);
+  }
+
+  // Killed commands are reported as shells do: 128 + signal
+  static void SetExit(CommandStats &stats, int rc) {
+    stats.signaled = WIFSIGNALED(rc);
+    if (stats.signaled) {
+      stats.status = 128 + WTERMSIG(rc);
+    } else {
+      stats.status = WIFEXITED(rc) ? WEXITSTATUS(rc) : 0;
+    }
+  }
+
+  // A killed run (e.g. by the watchdog) says nothing about the command, so
+  // coalesced waiters get it but it is not stored
+  static void Complete(ResultCache &cache, uint64_t key, const std::string &cmd,
+                       const CommandStats &stats, const std::string &output) {
+    if (stats.signaled) {
+      cache.Abandon(key, cmd, {output, stats.status});
+    } else {
+      cache.Complete(key, cmd, {output, stats.status});
+    }
+  }
+
+  static std::unique_ptr<StreamPump> MakePump() {
+    if (output_.mode == OutputMode::kCapture) {
+      return nullptr;
+    }
+    return std::make_unique<StreamPump>(output_);
+  }
+
+  // Fills status, timings and resource usage of `stats`
+  std::string execCommand(const std::string cmd, CommandStats &stats) {
+    if (backend_.load() == LaunchBackend::kPopen &&
+        output_.mode == OutputMode::kCapture) {
+      return execPopen(cmd, stats);
+    }
+
+    auto start = SteadyClock::now();
+    auto child = Spawn(cmd);
+    auto spawned = SteadyClock::now();
+    stats.spawn_ms = ToMs(spawned - start);
+    auto watch = Watch(child.pid);
+
+    // A command may close its stdout and keep running, so it stays watched
+    // until it is reaped
+    rusage usage{};
+    auto wait = [&] {
+      ::close(child.out_fd);
+      SetExit(stats, Wait(child.pid, &usage));
+      Release(watch);
+      stats.run_ms = ToMs(SteadyClock::now() - spawned);
+      stats.SetUsage(usage);
+    };
+
+    if (auto pump = MakePump()) {
+      pump->Pump(child.out_fd);
+      wait();
+      return pump->TakeTail();
+    }
+
+    std::array<char, 4096> buffer;
+
+    std::string result;
+
+    while (true) {
+      auto bytes = ::read(child.out_fd, buffer.data(), buffer.size());
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        break;
+      }
+      result.append(buffer.data(), bytes);
+    }
+
+    wait();
+
+    return result;
+  }
+
+  // pclose does not report resource usage, so only timings are filled
+  std::string execPopen(const std::string cmd, CommandStats &stats) {
+    TRACE_SCOPE("popen");
+    auto start = SteadyClock::now();
     auto pPipe = ::popen(cmd.c_str(), "r");
     if (pPipe == nullptr) {
       throw std::runtime_error("Cannot open pipe");
     }
+    auto spawned = SteadyClock::now();
+    stats.spawn_ms = ToMs(spawned - start);
 
     std::array<char, 256> buffer;
 
@@ -62,17 +391,24 @@ private:
       result.append(buffer.data(), bytes);
     }
 
-    auto rc = ::pclose(pPipe);
-
-    if (WIFEXITED(rc)) {
-      out_exitStatus = WEXITSTATUS(rc);
-    }
+    SetExit(stats, ::pclose(pPipe));
+    stats.run_ms = ToMs(SteadyClock::now() - spawned);
 
     return result;
   }
 
   inline static std::atomic<size_t> counter{0};
+  inline static std::atomic<LaunchBackend> backend_{LaunchBackend::kSpawn};
+  inline static std::atomic<Zygote *> zygote_{nullptr};
+  inline static std::atomic<Watchdog *> watchdog_{nullptr};
+  inline static std::atomic<Reactor *> reactor_{nullptr};
+  inline static std::atomic<OutputWriter *> writer_{nullptr};
+  inline static std::atomic<StatsReporter *> stats_{nullptr};
+  inline static std::atomic<ResultCache *> cache_{nullptr};
+  inline static OutputOptions output_{};
   std::unique_ptr<Command> item_ptr_;
+  size_t task_num_{0};
+  SteadyClock::time_point created_{};
 };
 
 } // namespace data
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace data {
+
+// Resources used by one launched command. Times are in milliseconds.
+struct CommandStats {
+  size_t task_num{0};
+  std::string cmd;
+  int status{0};
+  // From launcher creation (submission) to the start on a pool thread
+  double queue_ms{0};
+  // Time spent in posix_spawn/popen
+  double spawn_ms{0};
+  // From spawn to the moment the child is reaped
+  double run_ms{0};
+  double user_ms{0};
+  double sys_ms{0};
+  long max_rss_kb{0};
+  bool cached{false};
+  // Killed by a signal, status is 128 + signal then
+  bool signaled{false};
+
+  void SetUsage(const rusage &usage) {
+    auto ms = [](const timeval &time) {
+      return time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+    };
+    user_ms = ms(usage.ru_utime);
+    sys_ms = ms(usage.ru_stime);
+    max_rss_kb = usage.ru_maxrss;
+  }
+};
+
+inline double ToMs(std::chrono::steady_clock::duration duration) {
+  return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+enum class StatsFormat { kCsv, kJsonl };
+
+// Writes one line per command to a file ("-" is stderr) and keeps the
+// numbers for the end of run percentile summary. Thread safe.
+class StatsReporter {
+public:
+  StatsReporter(const std::string &path, StatsFormat format)
+      : format_(format) {
+    if (path != "-") {
+      file_ = std::make_unique<std::ofstream>(path);
+    }
+    if (format_ == StatsFormat::kCsv) {
+      Out() << "task,status,cached,queue_ms,spawn_ms,run_ms,user_ms,sys_ms,"
+               "max_rss_kb,cmd\n";
+    }
+  }
+
+  void Add(const CommandStats &stats) {
+    std::string line = Format(stats);
+
+    std::unique_lock lock(mt_);
+    Out() << line;
+    samples_.push_back(Sample{stats.queue_ms, stats.spawn_ms, stats.run_ms,
+                              stats.user_ms + stats.sys_ms,
+                              static_cast<double>(stats.max_rss_kb)});
+  }
+
+  void PrintSummary(std::ostream &out) {
+    std::unique_lock lock(mt_);
+    Out().flush();
+
+    static constexpr std::array<const char *, 5> kNames{
+        "queue_ms", "spawn_ms", "run_ms", "cpu_ms", "max_rss_kb"};
+
+    out << "commands: " << samples_.size() << "\n";
+    if (samples_.empty()) {
+      return;
+    }
+
+    out << std::fixed << std::setprecision(2);
+    for (size_t i = 0; i < kNames.size(); ++i) {
+      std::vector<double> values;
+      for (auto &sample : samples_) {
+        values.push_back(sample.values[i]);
+      }
+      std::sort(values.begin(), values.end());
+
+      auto at = [&values](double percent) {
+        return values[std::min(values.size() - 1,
+                               static_cast<size_t>(values.size() * percent / 100))];
+      };
+      out << std::setw(12) << kNames[i] << ": p50=" << at(50)
+          << " p90=" << at(90) << " p99=" << at(99)
+          << " max=" << values.back() << "\n";
+    }
+    out << std::defaultfloat;
+  }
+
+private:
+  struct Sample {
+    std::array<double, 5> values;
+  };
+
+  std::string Format(const CommandStats &stats) const {
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(3);
+
+    if (format_ == StatsFormat::kCsv) {
+      line << stats.task_num << "," << stats.status << "," << stats.cached
+           << "," << stats.queue_ms << "," << stats.spawn_ms << ","
+           << stats.run_ms << "," << stats.user_ms << "," << stats.sys_ms
+           << "," << stats.max_rss_kb << ",\"";
+      for (char c : stats.cmd) {
+        line << (c == '"' ? "\"\"" : std::string(1, c));
+      }
+      line << "\"\n";
+      return line.str();
+    }
+
+    line << "{\"task\":" << stats.task_num << ",\"status\":" << stats.status
+         << ",\"cached\":" << (stats.cached ? "true" : "false")
+         << ",\"queue_ms\":" << stats.queue_ms
+         << ",\"spawn_ms\":" << stats.spawn_ms
+         << ",\"run_ms\":" << stats.run_ms << ",\"user_ms\":" << stats.user_ms
+         << ",\"sys_ms\":" << stats.sys_ms
+         << ",\"max_rss_kb\":" << stats.max_rss_kb << ",\"cmd\":\"";
+    for (unsigned char c : stats.cmd) {
+      if (c == '"' || c == '\\') {
+        line << '\\' << c;
+      } else if (c < 0x20) {
+        line << "\\u" << std::hex << std::setw(4) << std::setfill('0')
+             << static_cast<int>(c) << std::dec << std::setfill(' ');
+      } else {
+        line << c;
+      }
+    }
+    line << "\"}\n";
+    return line.str();
+  }
+
+  std::ostream &Out() { return file_ ? *file_ : std::cerr; }
+
+  const StatsFormat format_;
+  std::unique_ptr<std::ofstream> file_;
+
+  std::mutex mt_;
+  std::vector<Sample> samples_;
+};
+
+} // namespace data
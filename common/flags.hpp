@@ -0,0 +1,64 @@
+#pragma once
+
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace cli {
+
+// Minimal command line parser: `--name=value` and `--name` options, all the
+// rest is positional.
+class Flags {
+public:
+  Flags(int argc, char *argv[]) {
+    for (int i = 1; i < argc; ++i) {
+      std::string_view arg(argv[i]);
+      if (arg.substr(0, 2) != "--") {
+        positional_.emplace_back(arg);
+        continue;
+      }
+
+      arg.remove_prefix(2);
+      auto eq = arg.find('=');
+      if (eq == std::string_view::npos) {
+        options_.emplace(arg, "");
+      } else {
+        options_.emplace(arg.substr(0, eq), arg.substr(eq + 1));
+      }
+    }
+  }
+
+  const std::vector<std::string> &Positional() const { return positional_; }
+
+  bool Has(const std::string &name) const { return options_.count(name); }
+
+  std::optional<std::string> Get(const std::string &name) const {
+    auto it = options_.find(name);
+    if (it == options_.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  size_t GetNumber(const std::string &name, size_t default_value) const {
+    auto value = Get(name);
+    if (!value || value->empty()) {
+      return default_value;
+    }
+
+    try {
+      return std::stoul(*value);
+    } catch (const std::exception &) {
+      throw std::runtime_error("wrong value of --" + name + ": " + *value);
+    }
+  }
+
+private:
+  std::vector<std::string> positional_;
+  std::unordered_map<std::string, std::string> options_;
+};
+
+} // namespace cli
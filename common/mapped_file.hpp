@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace data {
+
+// Read-only mapping of a whole file. Pages are loaded on first access and
+// stay in the page cache, so a huge file does not cost anonymous memory.
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+      ::close(fd);
+      throw std::runtime_error("Cannot stat " + path);
+    }
+
+    size_ = info.st_size;
+    if (size_ > 0) {
+      data_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+
+    if (data_ == MAP_FAILED) {
+      throw std::runtime_error("Cannot map " + path);
+    }
+    if (size_ > 0) {
+      ::madvise(data_, size_, MADV_SEQUENTIAL);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (size_ > 0) {
+      ::munmap(data_, size_);
+    }
+  }
+
+  std::string_view Data() const {
+    return {static_cast<const char *>(data_), size_};
+  }
+
+private:
+  void *data_{nullptr};
+  size_t size_{0};
+};
+
+} // namespace data
@@ -0,0 +1,159 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <climits>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace data {
+
+enum class OutputOrder {
+  // Records are written as soon as tasks finish
+  kCompletion,
+  // Records are written in the order of sequence numbers, every number
+  // starting from zero has to be submitted exactly once
+  kSubmission
+};
+
+// Single writer thread for records produced by many tasks. Producers push
+// whole records into a lock-free stack, the writer takes all of them at
+// once and writes the batch with writev, so records never interleave and
+// producers never contend on a stream lock.
+class OutputWriter {
+public:
+  OutputWriter(int fd, OutputOrder order)
+      : fd_(fd), order_(order), thread_(&OutputWriter::Run, this) {}
+
+  OutputWriter(const OutputWriter &) = delete;
+  OutputWriter &operator=(const OutputWriter &) = delete;
+
+  // Writes everything submitted so far
+  ~OutputWriter() {
+    Push(new Record{0, {}, true, nullptr});
+    thread_.join();
+  }
+
+  // Empty text is allowed, it just moves submission order forward
+  void Submit(size_t seq, std::string text) {
+    Push(new Record{seq, std::move(text), false, nullptr});
+  }
+
+private:
+  struct Record {
+    size_t seq;
+    std::string text;
+    bool stop;
+    Record *next;
+  };
+
+  void Push(Record *record) {
+    Record *head = head_.load(std::memory_order_relaxed);
+    do {
+      record->next = head;
+    } while (!head_.compare_exchange_weak(head, record,
+                                          std::memory_order_release,
+                                          std::memory_order_relaxed));
+    if (head == nullptr) {
+      head_.notify_one();
+    }
+  }
+
+  void Run() {
+    bool stop = false;
+    while (!stop) {
+      head_.wait(nullptr, std::memory_order_acquire);
+      Record *head = head_.exchange(nullptr, std::memory_order_acquire);
+
+      // Stack has the newest record on top
+      std::vector<Record *> batch;
+      for (; head != nullptr; head = head->next) {
+        batch.push_back(head);
+      }
+      std::reverse(batch.begin(), batch.end());
+
+      std::vector<std::string> ready;
+      for (Record *record : batch) {
+        stop |= record->stop;
+        if (!record->stop) {
+          Order(record, ready);
+        }
+        delete record;
+      }
+
+      if (stop) {
+        // Keep whatever is left even if some numbers were never submitted
+        for (auto &[seq, text] : pending_) {
+          ready.push_back(std::move(text));
+        }
+        pending_.clear();
+      }
+
+      Write(ready);
+    }
+  }
+
+  void Order(Record *record, std::vector<std::string> &ready) {
+    if (order_ == OutputOrder::kCompletion) {
+      ready.push_back(std::move(record->text));
+      return;
+    }
+
+    pending_.emplace(record->seq, std::move(record->text));
+    for (auto it = pending_.begin();
+         it != pending_.end() && it->first == next_seq_;
+         it = pending_.erase(it), ++next_seq_) {
+      ready.push_back(std::move(it->second));
+    }
+  }
+
+  void Write(std::vector<std::string> &texts) {
+    std::vector<iovec> iov;
+    for (auto &text : texts) {
+      if (!text.empty()) {
+        iov.push_back(iovec{text.data(), text.size()});
+      }
+    }
+
+    size_t first = 0;
+    while (first < iov.size()) {
+      int count = std::min<size_t>(iov.size() - first, IOV_MAX);
+      auto bytes = ::writev(fd_, iov.data() + first, count);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes < 0) {
+        return;
+      }
+
+      // Skip fully written buffers and shift the partially written one
+      while (first < iov.size() && static_cast<size_t>(bytes) >= iov[first].iov_len) {
+        bytes -= iov[first].iov_len;
+        ++first;
+      }
+      if (first < iov.size()) {
+        iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + bytes;
+        iov[first].iov_len -= bytes;
+      }
+    }
+  }
+
+  const int fd_;
+  const OutputOrder order_;
+
+  std::atomic<Record *> head_{nullptr};
+
+  // Writer thread only
+  std::map<size_t, std::string> pending_;
+  size_t next_seq_{0};
+
+  std::thread thread_;
+};
+
+} // namespace data
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace thread_pool {
+
+// Lock-free histogram with power of two buckets: bucket i holds values in
+// [2^(i-1), 2^i). Recording is one relaxed increment, so it can stay on in
+// production.
+class Histogram {
+public:
+  static constexpr size_t kBuckets = 64;
+
+  struct Snapshot {
+    std::array<uint64_t, kBuckets> buckets{};
+    uint64_t count{0};
+    uint64_t sum{0};
+
+    uint64_t Average() const { return count ? sum / count : 0; }
+
+    // Upper bound of the bucket containing given percentile
+    uint64_t Percentile(double percent) const {
+      uint64_t rank = count * percent / 100;
+      uint64_t seen = 0;
+      for (size_t i = 0; i < kBuckets; ++i) {
+        seen += buckets[i];
+        if (seen > rank) {
+          return i == 0 ? 0 : uint64_t{1} << i;
+        }
+      }
+      return 0;
+    }
+  };
+
+  void Record(uint64_t value) {
+    size_t bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+    buckets_[std::min(bucket, kBuckets - 1)].fetch_add(
+        1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  Snapshot Get() const {
+    Snapshot res;
+    for (size_t i = 0; i < kBuckets; ++i) {
+      res.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+    }
+    res.count = count_.load(std::memory_order_relaxed);
+    res.sum = sum_.load(std::memory_order_relaxed);
+    return res;
+  }
+
+private:
+  std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+};
+
+// Written only by the owning worker, so every worker has own cache line
+struct alignas(64) WorkerCounters {
+  std::atomic<uint64_t> tasks{0};
+  std::atomic<uint64_t> busy_ns{0};
+  std::atomic<uint64_t> idle_ns{0};
+
+  void Add(std::atomic<uint64_t>& counter, uint64_t value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value,
+                  std::memory_order_relaxed);
+  }
+};
+
+struct WorkerMetrics {
+  uint64_t tasks{0};
+  uint64_t busy_ns{0};
+  uint64_t idle_ns{0};
+};
+
+struct PoolMetrics {
+  size_t threads{0};
+  size_t queue_depth{0};
+  size_t queue_depth_max{0};
+  uint64_t rejected{0};
+  // Enqueue to start latency and execution time, both in nanoseconds
+  Histogram::Snapshot wait_ns;
+  Histogram::Snapshot run_ns;
+  std::vector<WorkerMetrics> workers;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const PoolMetrics& metrics) {
+  uint64_t busy = 0, idle = 0;
+  for (auto& worker : metrics.workers) {
+    busy += worker.busy_ns;
+    idle += worker.idle_ns;
+  }
+
+  auto us = [](uint64_t ns) { return ns / 1000; };
+  out << "pool: threads=" << metrics.threads
+      << " queued=" << metrics.queue_depth
+      << " queued_max=" << metrics.queue_depth_max
+      << " rejected=" << metrics.rejected
+      << " tasks=" << metrics.run_ns.count
+      << " wait_us(avg/p50/p99)=" << us(metrics.wait_ns.Average()) << "/"
+      << us(metrics.wait_ns.Percentile(50)) << "/"
+      << us(metrics.wait_ns.Percentile(99))
+      << " run_us(avg/p50/p99)=" << us(metrics.run_ns.Average()) << "/"
+      << us(metrics.run_ns.Percentile(50)) << "/"
+      << us(metrics.run_ns.Percentile(99))
+      << " busy=" << (busy + idle ? 100 * busy / (busy + idle) : 0) << "%";
+  return out;
+}
+
+// Periodically writes metrics snapshot to stderr ("-") or to a file
+class MetricsReporter {
+public:
+  using Source = std::function<PoolMetrics()>;
+
+  MetricsReporter(Source source, const std::string& path,
+                  std::chrono::milliseconds interval)
+      : source_(std::move(source)), interval_(interval) {
+    if (path != "-") {
+      file_ = std::make_unique<std::ofstream>(path, std::ios::app);
+    }
+    thread_ = std::thread(&MetricsReporter::Run, this);
+  }
+
+  ~MetricsReporter() {
+    {
+      std::unique_lock lock(mt_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+private:
+  void Run() {
+    std::unique_lock lock(mt_);
+    bool last = false;
+    while (!last) {
+      last = cv_.wait_for(lock, interval_, [this] { return stop_; });
+      Out() << source_() << std::endl;
+    }
+  }
+
+  std::ostream& Out() { return file_ ? *file_ : std::cerr; }
+
+  Source source_;
+  std::chrono::milliseconds interval_;
+  std::unique_ptr<std::ofstream> file_;
+
+  std::mutex mt_;
+  std::condition_variable cv_;
+  bool stop_{false};
+  std::thread thread_;
+};
+
+} // namespace thread_pool
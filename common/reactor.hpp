@@ -0,0 +1,323 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "spawn.hpp"
+#include "stream.hpp"
+
+namespace data {
+
+// Collects output and exit statuses of running children. Every reactor
+// thread owns an epoll instance and multiplexes stdout pipes and pidfds of
+// its children, so the number of commands in flight is not limited by the
+// number of threads.
+class Reactor {
+public:
+  // Called on the reactor thread with whole output (or the captured tail in
+  // streaming mode), wait status and resources used by the child
+  using Callback = std::function<void(std::string output, int status,
+                                      const rusage &usage)>;
+
+  // Reaps a child which is not ours (see Zygote), blocks until it exits
+  using WaitFunction = std::function<int(pid_t pid, rusage *usage)>;
+
+  // With `wait` children are reaped with it once their pidfd reports the
+  // exit: pidfd_open works for any pid, not only for own children
+  explicit Reactor(size_t threads = 1, WaitFunction wait = nullptr)
+      : wait_(std::move(wait)) {
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i) {
+      loops_.push_back(std::make_unique<Loop>());
+    }
+    for (auto &loop : loops_) {
+      loop->thread = std::thread(&Reactor::Run, this, loop.get());
+    }
+  }
+
+  ~Reactor() {
+    WaitForAll();
+
+    for (auto &loop : loops_) {
+      loop->stop.store(true);
+      loop->Wake();
+      loop->thread.join();
+    }
+
+    std::unique_lock lock(done_mt_);
+    for (auto &reaper : reapers_) {
+      reaper.join();
+    }
+  }
+
+  // Takes ownership of child's pipe, `on_exit` is called once the pipe is
+  // drained and the child is reaped. With `pump` the output is streamed
+  // through it instead of being accumulated.
+  //
+  // The child is handed over to the loop thread, which registers its fds:
+  // once the first one is in epoll the child may be finished and freed at
+  // any moment, so nothing else touches it.
+  void Watch(ChildProcess child, Callback on_exit,
+             std::unique_ptr<StreamPump> pump = nullptr) {
+    auto watched = std::make_unique<Watched>();
+    watched->pump = std::move(pump);
+    watched->pid = child.pid;
+    watched->out_fd = child.out_fd;
+    watched->pid_fd = ::syscall(SYS_pidfd_open, child.pid, 0);
+    watched->on_exit = std::move(on_exit);
+
+    ::fcntl(watched->out_fd, F_SETFL,
+            ::fcntl(watched->out_fd, F_GETFL) | O_NONBLOCK);
+    if (watched->pid_fd >= 0) {
+      ::fcntl(watched->pid_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    in_flight_.fetch_add(1);
+    Loop &loop = *loops_[next_loop_.fetch_add(1) % loops_.size()];
+    {
+      std::unique_lock lock(loop.pending_mt);
+      loop.pending.push_back(watched.release());
+    }
+    loop.Wake();
+  }
+
+  size_t InFlight() const { return in_flight_.load(); }
+
+  void WaitForAll() {
+    std::unique_lock lock(done_mt_);
+    done_cv_.wait(lock, [this] { return in_flight_.load() == 0; });
+  }
+
+private:
+  struct Watched;
+
+  // epoll_event points to one of the two sources of a child
+  struct Source {
+    Watched *owner;
+    bool is_pid;
+  };
+
+  struct Watched {
+    pid_t pid{-1};
+    int out_fd{-1};
+    int pid_fd{-1};
+    bool exited{false};
+    int status{0};
+    rusage usage{};
+    std::string output;
+    std::unique_ptr<StreamPump> pump;
+    Callback on_exit;
+
+    // The pipe could not be watched, the child is only reaped
+    bool failed{false};
+
+    Source out_source{this, false};
+    Source pid_source{this, true};
+  };
+
+  struct Loop {
+    Loop() {
+      epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+      wake_fd = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+      if (epoll_fd < 0 || wake_fd < 0 || !Add(wake_fd, nullptr)) {
+        throw std::runtime_error("Cannot create reactor");
+      }
+    }
+
+    ~Loop() {
+      ::close(wake_fd);
+      ::close(epoll_fd);
+    }
+
+    bool Add(int fd, Source *source) {
+      epoll_event event{};
+      event.events = EPOLLIN;
+      event.data.ptr = source;
+      return ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0;
+    }
+
+    void Wake() {
+      uint64_t one = 1;
+      [[maybe_unused]] auto rc = ::write(wake_fd, &one, sizeof(one));
+    }
+
+    int epoll_fd{-1};
+    int wake_fd{-1};
+    std::atomic<bool> stop{false};
+    std::thread thread;
+
+    // Children passed by Watch which are not registered yet
+    std::mutex pending_mt;
+    std::vector<Watched *> pending;
+  };
+
+  void Run(Loop *loop) {
+    std::array<epoll_event, 64> events;
+    std::array<char, 64 * 1024> buffer;
+
+    while (!loop->stop.load()) {
+      int count = ::epoll_wait(loop->epoll_fd, events.data(), events.size(), -1);
+      for (int i = 0; i < count; ++i) {
+        auto *source = static_cast<Source *>(events[i].data.ptr);
+        if (source == nullptr) {
+          RegisterPending(loop);
+          continue;
+        }
+
+        Watched *watched = source->owner;
+        if (source->is_pid) {
+          Reap(loop, watched, WNOHANG);
+        } else {
+          Drain(loop, watched, buffer.data(), buffer.size());
+        }
+
+        if (watched->out_fd >= 0) {
+          continue;
+        }
+        if (watched->exited) {
+          Finish(watched);
+        } else if (watched->pid_fd < 0) {
+          ReapAside(loop, watched);
+        }
+      }
+    }
+  }
+
+  void RegisterPending(Loop *loop) {
+    uint64_t wakeups;
+    [[maybe_unused]] auto rc = ::read(loop->wake_fd, &wakeups, sizeof(wakeups));
+
+    std::vector<Watched *> pending;
+    {
+      std::unique_lock lock(loop->pending_mt);
+      pending.swap(loop->pending);
+    }
+    for (Watched *watched : pending) {
+      Register(loop, watched);
+    }
+  }
+
+  // Without pidfd in epoll the child is reaped aside once its stdout is
+  // closed. If even the pipe cannot be added, it is closed right away and
+  // the child is reported as failed after it exits.
+  void Register(Loop *loop, Watched *watched) {
+    if (watched->pid_fd >= 0 && !loop->Add(watched->pid_fd, &watched->pid_source)) {
+      ::close(watched->pid_fd);
+      watched->pid_fd = -1;
+    }
+    if (loop->Add(watched->out_fd, &watched->out_source)) {
+      return;
+    }
+
+    watched->failed = true;
+    ::close(watched->out_fd);
+    watched->out_fd = -1;
+    if (watched->pid_fd < 0) {
+      ReapAside(loop, watched);
+    }
+  }
+
+  void Drain(Loop *loop, Watched *watched, char *buffer, size_t size) {
+    while (true) {
+      auto bytes = ::read(watched->out_fd, buffer, size);
+      if (bytes > 0) {
+        if (watched->pump) {
+          watched->pump->Consume(buffer, bytes);
+        } else {
+          watched->output.append(buffer, bytes);
+        }
+        continue;
+      }
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes < 0 && errno == EAGAIN) {
+        return;
+      }
+
+      ::epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watched->out_fd, nullptr);
+      ::close(watched->out_fd);
+      watched->out_fd = -1;
+      return;
+    }
+  }
+
+  // With pidfd the child has exited when this is called, so `wait_` only
+  // takes its status
+  void Reap(Loop *loop, Watched *watched, int flags) {
+    int status = 0;
+    pid_t rc;
+    if (wait_) {
+      status = wait_(watched->pid, &watched->usage);
+      rc = status < 0 ? -1 : watched->pid;
+    } else {
+      while ((rc = ::wait4(watched->pid, &status, flags, &watched->usage)) < 0 &&
+             errno == EINTR)
+        ;
+    }
+    if (rc == 0) {
+      return;
+    }
+
+    watched->exited = true;
+    watched->status = rc < 0 ? -1 : status;
+    if (watched->pid_fd >= 0) {
+      ::epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watched->pid_fd, nullptr);
+      ::close(watched->pid_fd);
+    }
+  }
+
+  // Child may run long after closing its stdout, a blocking wait would stall
+  // every other child of the loop. Only without pidfd (kernels before 5.3).
+  void ReapAside(Loop *loop, Watched *watched) {
+    std::unique_lock lock(done_mt_);
+    reapers_.emplace_back([this, loop, watched] {
+      Reap(loop, watched, 0);
+      Finish(watched);
+    });
+  }
+
+  void Finish(Watched *watched) {
+    std::unique_ptr<Watched> holder(watched);
+    if (holder->pump) {
+      holder->output = holder->pump->TakeTail();
+    }
+    if (holder->failed) {
+      holder->status = -1;
+    }
+    holder->on_exit(std::move(holder->output), holder->status, holder->usage);
+
+    if (in_flight_.fetch_sub(1) == 1) {
+      std::unique_lock lock(done_mt_);
+      done_cv_.notify_all();
+    }
+  }
+
+  const WaitFunction wait_;
+  std::vector<std::unique_ptr<Loop>> loops_;
+  std::atomic<size_t> next_loop_{0};
+  std::atomic<size_t> in_flight_{0};
+
+  std::mutex done_mt_;
+  std::condition_variable done_cv_;
+  std::list<std::thread> reapers_;
+};
+
+} // namespace data
@@ -0,0 +1,250 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace data {
+
+struct CachedResult {
+  std::string output;
+  int status{0};
+};
+
+struct CacheOptions {
+  std::string dir;
+  std::chrono::seconds ttl{std::chrono::hours(1)};
+  // The working directory is always part of the key, environment only if
+  // commands depend on it
+  bool fingerprint_env{false};
+};
+
+// On-disk cache of command results for deterministic commands. Every entry
+// is one file named by the key:
+//
+//   Header | command bytes | output bytes
+//
+// The file is mapped and validated on lookup and written to a temporary
+// file and renamed on store, so readers never see partial entries.
+// Concurrent runs of the same command within the process are coalesced:
+// only the first caller runs it, the rest get its result.
+class ResultCache {
+public:
+  using Waiter = std::function<void(const CachedResult &)>;
+
+  explicit ResultCache(const CacheOptions &options) : options_(options) {
+    if (::mkdir(options_.dir.c_str(), 0755) != 0 && errno != EEXIST) {
+      throw std::runtime_error("Cannot create cache dir " + options_.dir);
+    }
+
+    char cwd[4096];
+    if (::getcwd(cwd, sizeof(cwd))) {
+      fingerprint_ = Hash(cwd, fingerprint_);
+    }
+
+    if (options_.fingerprint_env) {
+      std::vector<std::string_view> env;
+      for (char **var = environ; *var; ++var) {
+        env.emplace_back(*var);
+      }
+      std::sort(env.begin(), env.end());
+      for (auto var : env) {
+        fingerprint_ = Hash(var, fingerprint_);
+      }
+    }
+  }
+
+  uint64_t Key(std::string_view cmd) const { return Hash(cmd, fingerprint_); }
+
+  std::optional<CachedResult> Lookup(uint64_t key,
+                                     std::string_view cmd) const {
+    int fd = ::open(Path(key).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return std::nullopt;
+    }
+
+    struct stat info;
+    void *data = MAP_FAILED;
+    if (::fstat(fd, &info) == 0 && static_cast<size_t>(info.st_size) >= sizeof(Header)) {
+      data = ::mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      return std::nullopt;
+    }
+
+    std::optional<CachedResult> res;
+    const char *bytes = static_cast<const char *>(data);
+    Header header;
+    std::memcpy(&header, bytes, sizeof(header));
+
+    bool valid = std::memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+                 header.version == kVersion && header.key == key &&
+                 sizeof(Header) + header.cmd_size + header.output_size ==
+                     static_cast<uint64_t>(info.st_size) &&
+                 std::string_view(bytes + sizeof(Header), header.cmd_size) == cmd;
+
+    if (valid && Now() - header.created < options_.ttl.count()) {
+      res = CachedResult{
+          std::string(bytes + sizeof(Header) + header.cmd_size,
+                      header.output_size),
+          header.status};
+    }
+
+    ::munmap(data, info.st_size);
+    return res;
+  }
+
+  void Store(uint64_t key, std::string_view cmd, const CachedResult &result) {
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.status = result.status;
+    header.created = Now();
+    header.key = key;
+    header.cmd_size = cmd.size();
+    header.output_size = result.output.size();
+
+    auto tmp = Path(key) + ".tmp." + std::to_string(::getpid()) + "." +
+               std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return;
+    }
+
+    bool ok = WriteAll(fd, &header, sizeof(header)) &&
+              WriteAll(fd, cmd.data(), cmd.size()) &&
+              WriteAll(fd, result.output.data(), result.output.size());
+    ::close(fd);
+
+    if (!ok || ::rename(tmp.c_str(), Path(key).c_str()) != 0) {
+      ::unlink(tmp.c_str());
+    }
+  }
+
+  // Returns true if the caller has to run the command and then call
+  // Complete or Abandon. Otherwise the same command is already running and
+  // `waiter` is called with its result. A different command with the same
+  // key is not coalesced, it just runs.
+  bool Acquire(uint64_t key, std::string_view cmd, Waiter waiter) {
+    std::unique_lock lock(mt_);
+    auto [it, inserted] = in_flight_.try_emplace(key);
+    if (inserted) {
+      it->second.cmd = cmd;
+    } else if (it->second.cmd == cmd) {
+      it->second.waiters.push_back(std::move(waiter));
+      return false;
+    }
+    return true;
+  }
+
+  void Complete(uint64_t key, std::string_view cmd, const CachedResult &result) {
+    Store(key, cmd, result);
+    Release(key, cmd, result);
+  }
+
+  // The command could not be run or was killed: waiters get `result`,
+  // nothing is stored
+  void Abandon(uint64_t key, std::string_view cmd, const CachedResult &result) {
+    Release(key, cmd, result);
+  }
+
+private:
+  static constexpr char kMagic[8] = {'C', 'M', 'D', 'C', 'A', 'C', 'H', 'E'};
+  static constexpr uint32_t kVersion = 1;
+
+  struct Header {
+    char magic[8];
+    uint32_t version{kVersion};
+    int32_t status{0};
+    int64_t created{0};
+    uint64_t key{0};
+    uint64_t cmd_size{0};
+    uint64_t output_size{0};
+  };
+
+  // FNV-1a
+  static uint64_t Hash(std::string_view data,
+                       uint64_t hash = 14695981039346656037ull) {
+    for (unsigned char c : data) {
+      hash ^= c;
+      hash *= 1099511628211ull;
+    }
+    return hash;
+  }
+
+  static int64_t Now() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  static bool WriteAll(int fd, const void *data, size_t size) {
+    auto *cur = static_cast<const char *>(data);
+    while (size > 0) {
+      auto bytes = ::write(fd, cur, size);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes < 0) {
+        return false;
+      }
+      cur += bytes;
+      size -= bytes;
+    }
+    return true;
+  }
+
+  void Release(uint64_t key, std::string_view cmd, const CachedResult &result) {
+    std::vector<Waiter> waiters;
+    {
+      std::unique_lock lock(mt_);
+      auto it = in_flight_.find(key);
+      if (it != in_flight_.end() && it->second.cmd == cmd) {
+        waiters = std::move(it->second.waiters);
+        in_flight_.erase(it);
+      }
+    }
+
+    for (auto &waiter : waiters) {
+      waiter(result);
+    }
+  }
+
+  std::string Path(uint64_t key) const {
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx",
+                  static_cast<unsigned long long>(key));
+    return options_.dir + "/" + name;
+  }
+
+  const CacheOptions options_;
+  uint64_t fingerprint_{Hash("")};
+
+  struct InFlight {
+    std::string cmd;
+    std::vector<Waiter> waiters;
+  };
+
+  std::mutex mt_;
+  std::unordered_map<uint64_t, InFlight> in_flight_;
+};
+
+} // namespace data
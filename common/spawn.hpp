@@ -0,0 +1,164 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+namespace data {
+
+struct ChildProcess {
+  pid_t pid{-1};
+  // Read end of the child's stdout
+  int out_fd{-1};
+};
+
+namespace impl {
+
+static constexpr std::string_view kShellMeta = "|&;<>()$`\\\"'*?[]#~{}!\n";
+
+// Builtins which do not exist as binaries or make no sense outside of shell
+static constexpr std::array<std::string_view, 28> kShellBuiltins{
+    ".",     "alias",   "bg",     "break",   "cd",       "command", "continue",
+    "eval",  "exec",    "exit",   "export",  "fg",       "getopts", "hash",
+    "jobs",  "read",    "readonly", "return", "set",     "shift",   "source",
+    "times", "trap",    "type",   "ulimit",  "umask",    "unset",   "wait"};
+
+class SpawnAttributes {
+public:
+  SpawnAttributes(int out_fd, bool own_group) {
+    posix_spawn_file_actions_init(&actions_);
+    // dup2 clears O_CLOEXEC on the child's stdout, all other pipe ends are
+    // created with it and get closed by exec
+    posix_spawn_file_actions_adddup2(&actions_, out_fd, STDOUT_FILENO);
+
+    // Signal mask survives exec, commands should not inherit signals blocked
+    // by the spawning thread (e.g. SIGCHLD in the zygote)
+    sigset_t empty;
+    sigemptyset(&empty);
+    posix_spawnattr_init(&attr_);
+    posix_spawnattr_setsigmask(&attr_, &empty);
+    short flags = POSIX_SPAWN_SETSIGMASK;
+    if (own_group) {
+      posix_spawnattr_setpgroup(&attr_, 0);
+      flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attr_, flags);
+  }
+
+  ~SpawnAttributes() {
+    posix_spawnattr_destroy(&attr_);
+    posix_spawn_file_actions_destroy(&actions_);
+  }
+
+  const posix_spawn_file_actions_t *Actions() const { return &actions_; }
+  const posix_spawnattr_t *Attr() const { return &attr_; }
+
+private:
+  posix_spawn_file_actions_t actions_;
+  posix_spawnattr_t attr_;
+};
+
+inline std::vector<char *> MakeArgv(std::vector<std::string> &args) {
+  std::vector<char *> argv;
+  for (auto &arg : args) {
+    argv.push_back(arg.data());
+  }
+  argv.push_back(nullptr);
+  return argv;
+}
+
+} // namespace impl
+
+// Splits command into argv words if it is a plain command which does not
+// need a shell to be run: no quoting, expansions, redirections, variable
+// assignments or builtins.
+inline std::optional<std::vector<std::string>>
+SplitSimpleCommand(std::string_view cmd) {
+  if (cmd.find_first_of(impl::kShellMeta) != std::string_view::npos) {
+    return std::nullopt;
+  }
+
+  std::vector<std::string> words;
+  size_t pos = 0;
+  while ((pos = cmd.find_first_not_of(" \t", pos)) != std::string_view::npos) {
+    size_t end = std::min(cmd.find_first_of(" \t", pos), cmd.size());
+    words.emplace_back(cmd.substr(pos, end - pos));
+    pos = end;
+  }
+
+  if (words.empty() || words[0].find('=') != std::string::npos ||
+      std::find(impl::kShellBuiltins.begin(), impl::kShellBuiltins.end(),
+                words[0]) != impl::kShellBuiltins.end()) {
+    return std::nullopt;
+  }
+
+  return words;
+}
+
+// Starts `cmd` with stdout redirected into a pipe. Simple commands are
+// executed directly, the rest goes through `/bin/sh -c` as with popen.
+// posix_spawn uses vfork semantics, so the parent's memory is never copied.
+// With `own_group` the child leads a new process group, which can be killed
+// as a whole.
+inline ChildProcess SpawnCommand(const std::string &cmd, bool own_group = false) {
+  int fds[2];
+  if (::pipe2(fds, O_CLOEXEC) != 0) {
+    throw std::runtime_error("Cannot open pipe");
+  }
+
+  impl::SpawnAttributes attributes(fds[1], own_group);
+  pid_t pid = -1;
+  int rc = ENOENT;
+
+  if (auto words = SplitSimpleCommand(cmd)) {
+    auto argv = impl::MakeArgv(*words);
+    rc = ::posix_spawnp(&pid, argv[0], attributes.Actions(), attributes.Attr(),
+                        argv.data(), environ);
+  }
+
+  // Not a simple command or it was not found, so let the shell report it
+  if (rc != 0) {
+    std::vector<std::string> args{"sh", "-c", cmd};
+    auto argv = impl::MakeArgv(args);
+    rc = ::posix_spawn(&pid, "/bin/sh", attributes.Actions(), attributes.Attr(),
+                       argv.data(), environ);
+  }
+
+  ::close(fds[1]);
+  if (rc != 0) {
+    ::close(fds[0]);
+    throw std::runtime_error(std::string("Cannot spawn command: ") +
+                             std::strerror(rc));
+  }
+
+  return ChildProcess{pid, fds[0]};
+}
+
+// Same as pclose: waits for the child and returns its wait status.
+// Resources used by the child are stored into `usage` if it is given.
+inline int WaitChild(pid_t pid, rusage *usage = nullptr) {
+  int status = 0;
+  while (::wait4(pid, &status, 0, usage) < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return status;
+}
+
+} // namespace data
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <string>
+#include <string_view>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace data {
+
+enum class OutputMode {
+  // Whole output is kept in memory and printed after the command exits
+  kCapture,
+  // Output is forwarded to the destination while the command runs
+  kStream,
+  // Same as kStream, but last `tail_limit` bytes are captured as well and
+  // repeated in the record of the finished command
+  kStreamTail
+};
+
+struct OutputOptions {
+  OutputMode mode{OutputMode::kCapture};
+  int fd{STDOUT_FILENO};
+  size_t tail_limit{4096};
+};
+
+// Keeps last `limit` bytes of appended data
+class TailBuffer {
+public:
+  explicit TailBuffer(size_t limit) : limit_(limit) {}
+
+  void Append(std::string_view data) {
+    if (data.size() >= limit_) {
+      data_.assign(data.substr(data.size() - limit_));
+      return;
+    }
+
+    data_.append(data);
+    // Trim lazily to keep appends amortized O(1)
+    if (data_.size() > 2 * limit_) {
+      data_.erase(0, data_.size() - limit_);
+    }
+  }
+
+  std::string Take() {
+    if (data_.size() > limit_) {
+      data_.erase(0, data_.size() - limit_);
+    }
+    return std::move(data_);
+  }
+
+private:
+  size_t limit_;
+  std::string data_;
+};
+
+// Forwards child's output to the destination fd in constant memory. Data
+// moves pipe to fd with splice, without copying through user space, and
+// is duplicated with tee into a private pipe when the tail is needed.
+// Destinations which do not support splice fall back to read/write.
+class StreamPump {
+public:
+  explicit StreamPump(const OutputOptions &options)
+      : options_(options), tail_(options.tail_limit) {
+    if (options_.mode == OutputMode::kStreamTail &&
+        ::pipe2(tee_fds_, O_CLOEXEC) != 0) {
+      tee_fds_[0] = tee_fds_[1] = -1;
+    }
+  }
+
+  StreamPump(const StreamPump &) = delete;
+  StreamPump &operator=(const StreamPump &) = delete;
+
+  ~StreamPump() {
+    for (int fd : tee_fds_) {
+      if (fd >= 0) {
+        ::close(fd);
+      }
+    }
+  }
+
+  // Blocking: forwards everything from `in_fd` until EOF
+  void Pump(int in_fd) {
+    while (splice_ && PumpChunk(in_fd))
+      ;
+
+    std::array<char, kChunk> buffer;
+    while (true) {
+      auto bytes = ::read(in_fd, buffer.data(), buffer.size());
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        return;
+      }
+      Consume(buffer.data(), bytes);
+    }
+  }
+
+  // For data which was already read by the caller, e.g. by the reactor
+  void Consume(const char *data, size_t size) {
+    WriteAll(data, size);
+    if (options_.mode == OutputMode::kStreamTail) {
+      tail_.Append(std::string_view(data, size));
+    }
+  }
+
+  // Captured tail, empty for kStream
+  std::string TakeTail() { return tail_.Take(); }
+
+private:
+  static constexpr size_t kChunk = 64 * 1024;
+
+  // Returns false on EOF or when splice is not supported, the latter turns
+  // splice_ off and the rest is copied by Pump
+  bool PumpChunk(int in_fd) {
+    bool with_tail = options_.mode == OutputMode::kStreamTail && tee_fds_[1] >= 0;
+
+    ssize_t size = 0;
+    if (with_tail) {
+      // tee blocks until there is data in the pipe, 0 means EOF
+      while ((size = ::tee(in_fd, tee_fds_[1], kChunk, 0)) < 0 && errno == EINTR)
+        ;
+      if (size <= 0) {
+        splice_ = size == 0;
+        return false;
+      }
+    } else {
+      size = kChunk;
+    }
+
+    ssize_t moved = 0;
+    while (moved < size) {
+      auto bytes = ::splice(in_fd, nullptr, options_.fd, nullptr, size - moved,
+                            SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes < 0) {
+        // The rest is still in the pipe and will be copied by Pump, so only
+        // the moved part of the tee'd copy belongs to the tail
+        splice_ = false;
+        if (with_tail) {
+          ReadTee(moved);
+          DropTee(size - moved);
+        }
+        return false;
+      }
+      if (bytes == 0) {
+        break;
+      }
+      moved += bytes;
+      if (!with_tail) {
+        break;
+      }
+    }
+
+    if (with_tail) {
+      ReadTee(size);
+    }
+    return moved > 0;
+  }
+
+  void ReadTee(size_t size) {
+    std::array<char, kChunk> buffer;
+    while (size > 0) {
+      auto bytes = ::read(tee_fds_[0], buffer.data(), std::min(size, kChunk));
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        return;
+      }
+      tail_.Append(std::string_view(buffer.data(), bytes));
+      size -= bytes;
+    }
+  }
+
+  void DropTee(size_t size) {
+    std::array<char, kChunk> buffer;
+    while (size > 0) {
+      auto bytes = ::read(tee_fds_[0], buffer.data(), std::min(size, kChunk));
+      if (bytes <= 0) {
+        return;
+      }
+      size -= bytes;
+    }
+  }
+
+  void WriteAll(const char *data, size_t size) {
+    while (size > 0) {
+      auto bytes = ::write(options_.fd, data, size);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes < 0) {
+        return;
+      }
+      data += bytes;
+      size -= bytes;
+    }
+  }
+
+  const OutputOptions options_;
+  TailBuffer tail_;
+  int tee_fds_[2]{-1, -1};
+  bool splice_{true};
+};
+
+} // namespace data
@@ -5,24 +5,67 @@
 
 #include <iostream>
 
+#include "trace.hpp"
+
 namespace thread_pool {
 
+// Completion counter shared by all tasks submitted in one batch. It is
+// created by ThreadPool::AddTasks with the number of accepted tasks.
+class TaskGroup {
+public:
+  explicit TaskGroup(size_t size) : size_(size), remaining_(size) {}
+
+  size_t Size() const { return size_; }
+  bool Done() const { return remaining_.load() == 0; }
+
+  void Wait() {
+    TRACE_SCOPE("task_group_wait");
+    size_t remaining = remaining_.load();
+    while (remaining != 0) {
+      remaining_.wait(remaining);
+      remaining = remaining_.load();
+    }
+  }
+
+  void Complete() {
+    if (remaining_.fetch_sub(1) == 1) {
+      remaining_.notify_all();
+    }
+  }
+
+private:
+  const size_t size_;
+  std::atomic<size_t> remaining_;
+};
+
+using TaskGroupPtr = std::shared_ptr<TaskGroup>;
+
 template <typename Callable> 
 class Task {
 public:
   Task(Callable &&run) : run_(std::move(run)) {}
 
+  void SetGroup(TaskGroupPtr group) { group_ = std::move(group); }
+
   void Execute() {
     run_();
     done_.store(true);
     done_.notify_one();
+
+    if (group_) {
+      group_->Complete();
+    }
   }
 
-  void Wait() { done_.wait(false); }
+  void Wait() {
+    TRACE_SCOPE("task_wait");
+    done_.wait(false);
+  }
 
 private:
   Callable run_;
   std::atomic<int> done_{false};
+  TaskGroupPtr group_{nullptr};
 };
 
 template <typename Callable> 
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <optional>
+#include <queue>
+#include <vector>
+
+#include "task.hpp"
+
+namespace thread_pool {
+
+using Clock = std::chrono::steady_clock;
+
+enum class Priority {
+  kHigh, kNormal, kLow
+};
+
+static constexpr size_t kLanesCount = 3;
+
+struct LaneStats {
+  size_t submitted{0};
+  size_t started{0};
+  // Tasks which were started after their deadline
+  size_t deadline_missed{0};
+  Clock::duration total_wait{0};
+  Clock::duration max_wait{0};
+
+  Clock::duration AverageWait() const {
+    return started ? total_wait / static_cast<Clock::rep>(started)
+                   : Clock::duration{0};
+  }
+};
+
+// Queue of pending tasks split into priority lanes. Tasks without deadline
+// are kept in plain FIFO, tasks with deadline are ordered earliest deadline
+// first and go before FIFO ones of the same lane. To avoid starvation every
+// `aging_step` of waiting lifts a lane one priority higher, counted from the
+// older of its two heads; a lifted lane gives that older task first, so FIFO
+// tasks do not wait behind a steady stream of deadline ones.
+//
+// Not thread safe, owner has to protect it.
+template <typename Callable>
+class TaskQueue {
+public:
+  struct Entry {
+    TaskWrapper<Callable> wrapper;
+    Clock::time_point enqueued;
+    std::optional<Clock::time_point> deadline;
+    Priority priority;
+    // An idle worker was reserved for the task when it was added
+    bool reserved;
+  };
+
+  explicit TaskQueue(Clock::duration aging_step) : aging_step_(aging_step) {}
+
+  void Push(TaskWrapper<Callable>&& wrapper, Priority priority,
+            std::optional<Clock::time_point> deadline, Clock::time_point now,
+            bool reserved) {
+    Lane& lane = lanes_[static_cast<size_t>(priority)];
+    Entry entry{std::move(wrapper), now, deadline, priority, reserved};
+
+    if (deadline) {
+      lane.by_deadline.push(std::move(entry));
+    } else {
+      lane.fifo.push_back(std::move(entry));
+    }
+    ++size_;
+  }
+
+  // Queue must not be empty
+  Entry Pop(Clock::time_point now) {
+    Lane* best = nullptr;
+    Clock::rep best_rank = 0;
+    bool best_aged = false;
+
+    for (size_t i = 0; i < kLanesCount; ++i) {
+      Lane& lane = lanes_[i];
+      const Entry* oldest = lane.Oldest();
+      if (!oldest) {
+        continue;
+      }
+
+      Clock::rep rank = i;
+      if (aging_step_.count() > 0) {
+        rank -= (now - oldest->enqueued) / aging_step_;
+      }
+
+      if (!best || rank < best_rank) {
+        best = &lane;
+        best_rank = rank;
+        best_aged = rank < static_cast<Clock::rep>(i);
+      }
+    }
+
+    --size_;
+    return best->PopFront(best_aged);
+  }
+
+  bool Empty() const { return size_ == 0; }
+  size_t Size() const { return size_; }
+
+private:
+  struct LaterDeadline {
+    bool operator()(const Entry& lhs, const Entry& rhs) const {
+      return *lhs.deadline > *rhs.deadline;
+    }
+  };
+
+  struct Lane {
+    std::deque<Entry> fifo;
+    std::priority_queue<Entry, std::vector<Entry>, LaterDeadline> by_deadline;
+
+    const Entry* Oldest() const {
+      if (by_deadline.empty()) {
+        return fifo.empty() ? nullptr : &fifo.front();
+      }
+      if (!fifo.empty() && fifo.front().enqueued < by_deadline.top().enqueued) {
+        return &fifo.front();
+      }
+      return &by_deadline.top();
+    }
+
+    // Deadline order first, the oldest head once the lane is aged
+    Entry PopFront(bool aged) {
+      bool from_fifo = !fifo.empty() &&
+                       (by_deadline.empty() || (aged && Oldest() == &fifo.front()));
+      if (!from_fifo) {
+        // top() is const, but the entry is removed right after
+        Entry entry = std::move(const_cast<Entry&>(by_deadline.top()));
+        by_deadline.pop();
+        return entry;
+      }
+
+      Entry entry = std::move(fifo.front());
+      fifo.pop_front();
+      return entry;
+    }
+  };
+
+  const Clock::duration aging_step_;
+  std::array<Lane, kLanesCount> lanes_;
+  size_t size_{0};
+};
+
+} // namespace thread_pool
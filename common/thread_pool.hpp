@@ -1,17 +1,25 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
+#include <list>
 #include <mutex>
-#include <queue>
+#include <optional>
 #include <thread>
 #include <vector>
 
 #include <iostream>
 #include <cassert>
 
+#include "pool_metrics.hpp"
 #include "task.hpp"
+#include "task_queue.hpp"
+#include "topology.hpp"
+#include "trace.hpp"
 
 namespace thread_pool {
 
@@ -19,36 +27,84 @@ enum class OverflowPolicy {
   kAllow, kReject
 };
 
+// Worker i is pinned to cpus[i % cpus.size()] when the list is not empty.
+// With numa_aware every NUMA node has own queue: tasks go to the queue of
+// the submitter's node and workers take local tasks first, so the data
+// prepared by the submitter is mostly touched from the same node.
+struct Placement {
+  std::vector<int> cpus;
+  bool numa_aware{false};
+};
+
+// Elastic mode: workers are spawned on demand when a task would otherwise
+// wait in the queue, up to max_threads. Workers above min_threads exit after
+// being idle for keep_alive. See TaskQueue for aging_step.
+struct ThreadPoolOptions {
+  size_t min_threads{0};
+  size_t max_threads{1};
+  std::chrono::milliseconds keep_alive{std::chrono::seconds(10)};
+  std::chrono::milliseconds aging_step{std::chrono::milliseconds(100)};
+  Placement placement{};
+};
+
 template <typename Callable>
 class ThreadPool {
 public:
-  using TaskPtr =std::shared_ptr<Task<Callable>>; 
+  using TaskPtr =std::shared_ptr<Task<Callable>>;
 
-  ThreadPool(size_t size, OverflowPolicy policy)
-      : size_(size), policy_(policy) {
+  // Fixed size pool, all threads are started at once.
+  ThreadPool(size_t size, OverflowPolicy policy,
+             const Placement& placement = {})
+      : min_(size), max_(size), elastic_(false), policy_(policy),
+        placement_(placement) {
 
     assert(size > 0);
 
-    waiters_.store(0);
-    threads_.reserve(size_);
-    for (int i = 0; i < size_; i++) {
-      threads_.emplace_back(std::bind(&ThreadPool::ThreadTask, this));
+    // Workers are idle from the very beginning, so there is no need to wait
+    // until every thread actually reaches its queue.
+    waiters_.store(size);
+    InitQueues(ThreadPoolOptions{}.aging_step);
+    InitWorkerSlots();
+    std::unique_lock lock(threads_mt_);
+    for (size_t i = 0; i < size; i++) {
+      SpawnWorker();
     }
-    while (!Started())
-      ;
+  }
+
+  // Elastic pool, threads are started lazily by AddTask.
+  ThreadPool(const ThreadPoolOptions& options, OverflowPolicy policy)
+      : min_(options.min_threads), max_(options.max_threads), elastic_(true),
+        keep_alive_(options.keep_alive), policy_(policy),
+        placement_(options.placement) {
+
+    assert(max_ > 0 && min_ <= max_);
+
+    waiters_.store(0);
+    InitQueues(options.aging_step);
+    InitWorkerSlots();
   }
 
   void WaitForTasks() {
     std::unique_lock lock(wait_end_mt_);
 
-    wait_end_cv_.wait(lock, [this]() { return tasks_.empty(); });
+    wait_end_cv_.wait(lock, [this]() { return queued_.load() == 0; });
   }
 
-  TaskPtr AddTask(Callable&& task) {
-    if (!waiters_.fetch_sub(1)) {
-      waiters_.fetch_add(1);
+  // Unlike WaitForTasks also waits for already started tasks
+  void WaitForIdle() {
+    std::unique_lock lock(wait_end_mt_);
+
+    wait_end_cv_.wait(lock, [this]() {
+      return queued_.load() == 0 && running_.load() == 0;
+    });
+  }
 
+  TaskPtr AddTask(Callable&& task, Priority priority = Priority::kNormal,
+                  std::optional<Clock::time_point> deadline = std::nullopt) {
+    bool reserved = ReserveWorkers(1) || TryGrow(1);
+    if (!reserved) {
       if (policy_ == OverflowPolicy::kReject) {
+        rejected_.fetch_add(1, std::memory_order_relaxed);
         return nullptr;
       }
     }
@@ -58,14 +114,121 @@ public:
       std::unique_lock lock(wait_for_task_mt_);
       TaskWrapper<Callable> wrapper(std::move(task));
       res = wrapper.GetPtr();
-      tasks_.push(std::move(wrapper));
+      SubmitQueue().Push(std::move(wrapper), priority, deadline, Clock::now(),
+                         reserved);
+      CountQueued(1);
+      if (!reserved) {
+        KeepWorker();
+      }
     }
+    lanes_[static_cast<size_t>(priority)].submitted.fetch_add(1);
 
     wait_for_task_cv_.notify_one();
     return res;
   }
 
-  bool Started() const { return waiters_.load() == size_; }
+  // Enqueues a whole batch under one lock and wakes at most as many workers
+  // as there are idle ones. Callables are moved out of [first, last). With
+  // kReject only the prefix that fits into idle workers is accepted, the
+  // size of returned group tells how many; nullptr if nothing was accepted.
+  template <typename It>
+  TaskGroupPtr AddTasks(It first, It last,
+                        Priority priority = Priority::kNormal) {
+    size_t count = std::distance(first, last);
+    if (count == 0) {
+      return nullptr;
+    }
+
+    size_t reserved = ReserveWorkers(count);
+    reserved += TryGrow(count - reserved);
+
+    if (policy_ == OverflowPolicy::kReject) {
+      rejected_.fetch_add(count - reserved, std::memory_order_relaxed);
+      if (reserved == 0) {
+        return nullptr;
+      }
+      count = reserved;
+    }
+
+    auto group = std::make_shared<TaskGroup>(count);
+    {
+      auto now = Clock::now();
+      std::unique_lock lock(wait_for_task_mt_);
+      auto& queue = SubmitQueue();
+      for (size_t i = 0; i < count; ++i, ++first) {
+        TaskWrapper<Callable> wrapper(std::move(*first));
+        wrapper.GetPtr()->SetGroup(group);
+        queue.Push(std::move(wrapper), priority, std::nullopt, now, i < reserved);
+      }
+      CountQueued(count);
+      if (reserved < count) {
+        KeepWorker();
+      }
+    }
+    lanes_[static_cast<size_t>(priority)].submitted.fetch_add(count);
+
+    if (reserved >= live_.load()) {
+      wait_for_task_cv_.notify_all();
+    } else {
+      for (size_t i = 0; i < reserved; ++i) {
+        wait_for_task_cv_.notify_one();
+      }
+    }
+    return group;
+  }
+
+  // A task would be started right away: there is an idle worker or a
+  // thread can still be started
+  bool HasCapacity() const {
+    return waiters_.load() > 0 || live_.load() < max_;
+  }
+
+  // Returns false if there is still no capacity at `until`
+  bool WaitForCapacity(Clock::time_point until) {
+    std::unique_lock lock(wait_end_mt_);
+    capacity_waiters_.fetch_add(1);
+    bool res = wait_end_cv_.wait_until(lock, until,
+                                       [this] { return HasCapacity(); });
+    capacity_waiters_.fetch_sub(1);
+    return res;
+  }
+
+  // All started workers are idle
+  bool Started() const {
+    return waiters_.load() == static_cast<int>(live_.load());
+  }
+
+  size_t Size() const { return live_.load(); }
+
+  LaneStats GetLaneStats(Priority priority) const {
+    const LaneCounters& lane = lanes_[static_cast<size_t>(priority)];
+
+    LaneStats stats;
+    stats.submitted = lane.submitted.load();
+    stats.started = lane.started.load();
+    stats.deadline_missed = lane.deadline_missed.load();
+    stats.total_wait = Clock::duration{lane.total_wait.load()};
+    stats.max_wait = Clock::duration{lane.max_wait.load()};
+    return stats;
+  }
+
+  PoolMetrics GetMetrics() const {
+    PoolMetrics metrics;
+    metrics.threads = live_.load();
+    metrics.queue_depth = queued_.load();
+    metrics.queue_depth_max = queued_max_.load(std::memory_order_relaxed);
+    metrics.rejected = rejected_.load(std::memory_order_relaxed);
+    metrics.wait_ns = wait_ns_.Get();
+    metrics.run_ns = run_ns_.Get();
+
+    metrics.workers.resize(max_);
+    for (size_t i = 0; i < max_; ++i) {
+      metrics.workers[i].tasks = workers_[i].tasks.load(std::memory_order_relaxed);
+      metrics.workers[i].busy_ns = workers_[i].busy_ns.load(std::memory_order_relaxed);
+      metrics.workers[i].idle_ns = workers_[i].idle_ns.load(std::memory_order_relaxed);
+    }
+    return metrics;
+  }
 
   ~ThreadPool() {
     WaitForTasks();
@@ -81,53 +244,307 @@ private:
 
     wait_for_task_cv_.notify_all();
 
-    for (std::thread& thread : threads_) {
+    // Retiring workers take threads_mt_, so join them outside of it
+    std::list<std::thread> threads;
+    {
+      std::unique_lock lock(threads_mt_);
+      threads.swap(threads_);
+    }
+
+    for (std::thread& thread : threads) {
       thread.join();
     }
   }
 
-  void ThreadTask() {
-    while (!terminate_) {
-      waiters_.fetch_add(1);
+  // Takes up to `count` idle workers, returns how many were taken
+  size_t ReserveWorkers(size_t count) {
+    int idle = waiters_.load();
+    int reserved = 0;
+    do {
+      reserved = std::clamp<int>(idle, 0, count);
+    } while (reserved > 0 &&
+             !waiters_.compare_exchange_weak(idle, idle - reserved));
+
+    return reserved;
+  }
 
+  // Starts up to `count` new workers in elastic mode. Every new worker is
+  // already reserved for one of the tasks being added.
+  size_t TryGrow(size_t count) {
+    if (!elastic_ || count == 0) {
+      return 0;
+    }
+
+    std::unique_lock lock(threads_mt_);
+    JoinRetired();
+
+    size_t started = 0;
+    while (started < count && live_.load() < max_) {
+      SpawnWorker();
+      ++started;
+    }
+
+    return started;
+  }
+
+  // Requires wait_for_task_mt_ and a queued task nobody was reserved for.
+  // Live workers do not retire while something is queued, but the last one
+  // may have retired before the task was pushed, then a new one is started.
+  void KeepWorker() {
+    if (!elastic_ || live_.load() > 0) {
+      return;
+    }
+
+    std::unique_lock lock(threads_mt_);
+    waiters_.fetch_add(1);
+    SpawnWorker();
+  }
+
+  void InitQueues(Clock::duration aging_step) {
+    size_t nodes =
+        placement_.numa_aware ? topology::Topology::Get().Nodes() : 1;
+    for (size_t i = 0; i < nodes; ++i) {
+      queues_.emplace_back(aging_step);
+    }
+  }
+
+  // Requires wait_for_task_mt_
+  TaskQueue<Callable>& SubmitQueue() {
+    if (queues_.size() == 1) {
+      return queues_[0];
+    }
+    return queues_[topology::Topology::Get().CurrentNode()];
+  }
+
+  // Requires wait_for_task_mt_ and at least one queued task. Local queue
+  // goes first, then the others are stolen from.
+  typename TaskQueue<Callable>::Entry PopTask(int cpu, Clock::time_point now) {
+    size_t local = 0;
+    if (queues_.size() > 1) {
+      local = topology::Topology::Get().NodeOfCpu(cpu < 0 ? sched_getcpu()
+                                                          : cpu);
+    }
+
+    for (size_t i = 0; i < queues_.size(); ++i) {
+      auto& queue = queues_[(local + i) % queues_.size()];
+      if (!queue.Empty()) {
+        return queue.Pop(now);
+      }
+    }
+
+    assert(false);
+    return queues_[local].Pop(now);
+  }
+
+  // Every live worker owns one slot of counters, slots of retired workers
+  // are reused by new ones.
+  void InitWorkerSlots() {
+    workers_ = std::make_unique<WorkerCounters[]>(max_);
+    for (size_t i = max_; i > 0; --i) {
+      free_slots_.push_back(i - 1);
+    }
+  }
+
+  // Requires threads_mt_ and live_ < max_, so there is a free slot
+  void SpawnWorker() {
+    size_t slot = free_slots_.back();
+    free_slots_.pop_back();
+
+    int cpu = -1;
+    if (!placement_.cpus.empty()) {
+      cpu = placement_.cpus[slot % placement_.cpus.size()];
+    }
+
+    live_.fetch_add(1);
+    threads_.emplace_back(std::bind(&ThreadPool::ThreadTask, this, slot, cpu));
+    if (cpu >= 0 && !topology::PinThread(threads_.back().native_handle(), cpu)) {
+      std::cerr << "Cannot pin worker to cpu " << cpu << std::endl;
+    }
+  }
+
+  // Requires threads_mt_
+  void JoinRetired() {
+    for (auto id : retired_) {
+      auto it = std::find_if(threads_.begin(), threads_.end(),
+                             [id](auto& thread) { return thread.get_id() == id; });
+      if (it != threads_.end()) {
+        it->join();
+        threads_.erase(it);
+      }
+    }
+    retired_.clear();
+  }
+
+  // Requires wait_for_task_mt_
+  void CountQueued(size_t count) {
+    size_t depth = queued_.fetch_add(count) + count;
+    TRACE_COUNTER("queue_depth", depth);
+    size_t max_depth = queued_max_.load(std::memory_order_relaxed);
+    while (max_depth < depth &&
+           !queued_max_.compare_exchange_weak(max_depth, depth))
+      ;
+  }
+
+  void CountStart(const typename TaskQueue<Callable>::Entry& entry,
+                  Clock::time_point now) {
+    LaneCounters& lane = lanes_[static_cast<size_t>(entry.priority)];
+    auto wait = (now - entry.enqueued).count();
+    wait_ns_.Record(ToNs(now - entry.enqueued));
+
+    lane.started.fetch_add(1);
+    lane.total_wait.fetch_add(wait);
+    auto max_wait = lane.max_wait.load();
+    while (max_wait < wait &&
+           !lane.max_wait.compare_exchange_weak(max_wait, wait))
+      ;
+
+    if (entry.deadline && *entry.deadline < now) {
+      lane.deadline_missed.fetch_add(1);
+    }
+  }
+
+  // Requires wait_for_task_mt_. Idle worker may leave only if it is above
+  // the minimum and nobody has reserved it yet. It leaves live_ and gives
+  // its slot back at once, so TryGrow always finds a slot below max_; the
+  // thread is joined by the next TryGrow.
+  bool TryRetire(size_t slot) {
+    std::unique_lock lock(threads_mt_);
+    if (live_.load() <= min_ || !ReserveWorkers(1)) {
+      return false;
+    }
+
+    live_.fetch_sub(1);
+    retired_.push_back(std::this_thread::get_id());
+    free_slots_.push_back(slot);
+    return true;
+  }
+
+  // `cpu` is the pinned cpu of the worker or -1 if it floats
+  void ThreadTask(size_t slot, int cpu) {
+    WorkerCounters& counters = workers_[slot];
+    auto idle_since = Clock::now();
+    TRACE_THREAD_NAME("pool worker");
+
+    while (true) {
       TaskWrapper<Callable> wrapper;
       {
         std::unique_lock lock(wait_for_task_mt_);
 
-        wait_for_task_cv_.wait(
-            lock, [this] { return !tasks_.empty() || terminate_; });
+        auto ready = [this] { return queued_.load() != 0 || terminate_; };
+        bool timeout = false;
+        if (elastic_) {
+          timeout = !wait_for_task_cv_.wait_for(lock, keep_alive_, ready);
+        } else {
+          wait_for_task_cv_.wait(lock, ready);
+        }
 
-        if (tasks_.empty()) {
+        if (queued_.load() == 0) {
+          if (terminate_) {
+            return;
+          }
+          if (timeout) {
+            // The slot may be reused as soon as it is given back
+            counters.Add(counters.idle_ns, ToNs(Clock::now() - idle_since));
+            idle_since = Clock::now();
+            if (TryRetire(slot)) {
+              return;
+            }
+          }
           continue;
         }
 
-        wrapper = std::move(tasks_.front());
-        tasks_.pop();
+        auto now = Clock::now();
+        auto entry = PopTask(cpu, now);
+        // Nobody took an idle worker for this task, so this one stops being
+        // idle here. It becomes idle again after the task either way.
+        if (!entry.reserved) {
+          waiters_.fetch_sub(1);
+        }
+        running_.fetch_add(1);
+        [[maybe_unused]] size_t depth = queued_.fetch_sub(1) - 1;
+        lock.unlock();
+
+        wrapper = std::move(entry.wrapper);
+        CountStart(entry, now);
+        TRACE_COUNTER("queue_depth", depth);
+        TRACE_SPAN("queued", entry.enqueued, now);
+        counters.Add(counters.idle_ns, ToNs(now - idle_since));
       }
 
-      if (!terminate_) {
+      auto start = Clock::now();
+      {
+        TRACE_SCOPE("task");
         wrapper.GetPtr()->Execute();
+      }
+      idle_since = Clock::now();
+
+      uint64_t run = ToNs(idle_since - start);
+      run_ns_.Record(run);
+      counters.Add(counters.busy_ns, run);
+      counters.Add(counters.tasks, 1);
+
+      waiters_.fetch_add(1);
+      if ((running_.fetch_sub(1) == 1 && queued_.load() == 0) ||
+          capacity_waiters_.load() > 0) {
+        // Idle and capacity waiters check the state under this mutex, so
+        // take it to not lose the wakeup
+        std::unique_lock lock(wait_end_mt_);
+        wait_end_cv_.notify_all();
+      } else {
         wait_end_cv_.notify_one();
       }
     }
   }
 
-  const size_t size_;
+  static uint64_t ToNs(Clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+        .count();
+  }
+
+  const size_t min_;
+  const size_t max_;
+  const bool elastic_;
+  const std::chrono::milliseconds keep_alive_{0};
   OverflowPolicy policy_;
+  const Placement placement_;
 
-  std::vector<std::thread> threads_;
+  std::mutex threads_mt_;
+  std::list<std::thread> threads_;
+  std::vector<std::thread::id> retired_;
+  std::atomic<size_t> live_{0};
+  std::unique_ptr<WorkerCounters[]> workers_;
+  std::vector<size_t> free_slots_;
 
   // Use same approach as std::unordered_map. We have to use wrapper because
-  // std::queue has paged-vector as underlying type and pointers to it's items
-  // can be invalidated.
-  std::queue<TaskWrapper<Callable>> tasks_;
-
+  // lanes are deques and heaps, so pointers to their items can be
+  // invalidated. One queue per NUMA node in numa_aware mode.
+  std::vector<TaskQueue<Callable>> queues_;
+  std::atomic<size_t> queued_{0};
+  std::atomic<size_t> queued_max_{0};
+  std::atomic<size_t> running_{0};
+  std::atomic<uint64_t> rejected_{0};
+
+  Histogram wait_ns_;
+  Histogram run_ns_;
+
+  struct LaneCounters {
+    std::atomic<size_t> submitted{0};
+    std::atomic<size_t> started{0};
+    std::atomic<size_t> deadline_missed{0};
+    std::atomic<Clock::rep> total_wait{0};
+    std::atomic<Clock::rep> max_wait{0};
+  };
+  std::array<LaneCounters, kLanesCount> lanes_;
+
+  // Idle workers which are not reserved by already added tasks. Negative
+  // while more reserved tasks are queued than there are idle workers.
   std::atomic<int> waiters_;
   std::atomic<bool> terminate_{false};
 
   std::mutex wait_for_task_mt_;
   std::condition_variable wait_for_task_cv_;
 
+  std::atomic<size_t> capacity_waiters_{0};
   std::mutex wait_end_mt_;
   std::condition_variable wait_end_cv_;
 };
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace data {
+
+// Hierarchical timing wheel over integer ticks. Level L has 256 slots of
+// 256^L ticks each; a timer goes to the lowest level whose range covers
+// its distance from now and moves one level down every time the wheel
+// reaches its slot, so Add is O(1) and every timer is cascaded at most
+// kLevels - 1 times. Timers further than 256^kLevels ticks wait in an
+// overflow list. Timers of the same tick expire in the order of Add.
+template <typename T>
+class TimerWheel {
+public:
+  static constexpr size_t kLevels = 4;
+  static constexpr size_t kBits = 8;
+  static constexpr size_t kSlots = size_t{1} << kBits;
+
+  explicit TimerWheel(uint64_t now = 0) : now_(now) {}
+
+  // Timers which are already due expire on the next Advance
+  void Add(uint64_t expiry, T value) {
+    ++size_;
+    Place(Entry{expiry, std::move(value)});
+  }
+
+  // Moves the wheel to `now` and appends every expired value
+  void Advance(uint64_t now, std::vector<T> &expired) {
+    Collect(due_, expired);
+    if (size_ == 0) {
+      now_ = std::max(now_, now);
+      return;
+    }
+
+    while (now_ < now) {
+      // Nothing expires or cascades until the next rotation of the lowest
+      // level which is not empty
+      size_t empty = 0;
+      while (empty < kLevels && counts_[empty] == 0) {
+        ++empty;
+      }
+      if (empty > 0 && (now_ | Mask(empty)) > now_) {
+        now_ = std::min(now_ | Mask(empty), now);
+        continue;
+      }
+
+      ++now_;
+      for (size_t level = kLevels; level-- > 1;) {
+        if ((now_ & Mask(level)) == 0) {
+          Cascade(level);
+        }
+      }
+      if ((now_ & Mask(kLevels)) == 0) {
+        auto overflow = std::move(overflow_);
+        overflow_.clear();
+        for (auto &entry : overflow) {
+          Place(std::move(entry));
+        }
+      }
+
+      auto &slot = slots_[0][now_ & (kSlots - 1)];
+      counts_[0] -= slot.size();
+      Collect(slot, expired);
+      Collect(due_, expired);
+      if (size_ == 0) {
+        now_ = now;
+      }
+    }
+  }
+
+  // Earliest tick at which Advance may return something. It is a lower
+  // bound for timers on the upper levels: their slot is cascaded then.
+  // Levels are not ordered by expiry, a timer placed on an upper level long
+  // ago may be due before the ones on lower levels, so all are looked at.
+  std::optional<uint64_t> NextExpiry() const {
+    if (size_ == 0) {
+      return std::nullopt;
+    }
+    if (!due_.empty()) {
+      return now_;
+    }
+
+    std::optional<uint64_t> res;
+    auto take = [&res](uint64_t tick) {
+      res = std::min(res.value_or(tick), tick);
+    };
+    for (size_t level = 0; level < kLevels; ++level) {
+      if (counts_[level] == 0) {
+        continue;
+      }
+      uint64_t current = now_ >> (kBits * level);
+      for (uint64_t step = 1; step <= kSlots; ++step) {
+        if (!slots_[level][(current + step) & (kSlots - 1)].empty()) {
+          take((current + step) << (kBits * level));
+          break;
+        }
+      }
+    }
+
+    // Overflow is placed again at the next full rotation
+    if (!overflow_.empty()) {
+      take((now_ | Mask(kLevels)) + 1);
+    }
+    return res;
+  }
+
+  size_t Size() const { return size_; }
+
+private:
+  struct Entry {
+    uint64_t expiry;
+    T value;
+  };
+
+  static constexpr uint64_t Mask(size_t level) {
+    return (uint64_t{1} << (kBits * level)) - 1;
+  }
+
+  void Place(Entry entry) {
+    if (entry.expiry <= now_) {
+      due_.push_back(std::move(entry));
+      return;
+    }
+
+    uint64_t distance = entry.expiry - now_;
+    for (size_t level = 0; level < kLevels; ++level) {
+      if (distance <= Mask(level + 1)) {
+        auto slot = (entry.expiry >> (kBits * level)) & (kSlots - 1);
+        slots_[level][slot].push_back(std::move(entry));
+        ++counts_[level];
+        return;
+      }
+    }
+    overflow_.push_back(std::move(entry));
+  }
+
+  void Cascade(size_t level) {
+    auto &slot = slots_[level][(now_ >> (kBits * level)) & (kSlots - 1)];
+    auto entries = std::move(slot);
+    slot.clear();
+    counts_[level] -= entries.size();
+    for (auto &entry : entries) {
+      Place(std::move(entry));
+    }
+  }
+
+  void Collect(std::vector<Entry> &entries, std::vector<T> &expired) {
+    for (auto &entry : entries) {
+      expired.push_back(std::move(entry.value));
+    }
+    size_ -= entries.size();
+    entries.clear();
+  }
+
+  uint64_t now_;
+  size_t size_{0};
+  std::array<std::array<std::vector<Entry>, kSlots>, kLevels> slots_;
+  std::array<size_t, kLevels> counts_{};
+  std::vector<Entry> overflow_;
+  std::vector<Entry> due_;
+};
+
+} // namespace data
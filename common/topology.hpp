@@ -0,0 +1,129 @@
+#pragma once
+
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+namespace topology {
+
+// Parses kernel cpu list format, e.g. "0-3,8,10-11"
+inline std::vector<int> ParseCpuList(std::string_view list) {
+  std::vector<int> cpus;
+
+  while (!list.empty()) {
+    auto comma = list.find(',');
+    std::string range(list.substr(0, comma));
+    list.remove_prefix(comma == std::string_view::npos ? list.size()
+                                                       : comma + 1);
+    if (range.empty() || range == "\n") {
+      continue;
+    }
+
+    try {
+      auto dash = range.find('-');
+      int first = std::stoi(range.substr(0, dash));
+      int last = dash == std::string::npos ? first
+                                           : std::stoi(range.substr(dash + 1));
+      for (int cpu = first; cpu <= last; ++cpu) {
+        cpus.push_back(cpu);
+      }
+    } catch (const std::exception &) {
+      throw std::runtime_error("wrong cpu list: " + range);
+    }
+  }
+
+  return cpus;
+}
+
+// NUMA layout read from /sys/devices/system/node. Machines without sysfs
+// node info are treated as one node with all cpus.
+class Topology {
+public:
+  static const Topology &Get() {
+    static const Topology topology = Read();
+    return topology;
+  }
+
+  size_t Nodes() const { return node_cpus_.size(); }
+
+  const std::vector<int> &NodeCpus(size_t node) const {
+    return node_cpus_[node];
+  }
+
+  size_t NodeOfCpu(int cpu) const {
+    return cpu >= 0 && cpu < static_cast<int>(cpu_node_.size()) ? cpu_node_[cpu]
+                                                                : 0;
+  }
+
+  // Node the calling thread is running on right now
+  size_t CurrentNode() const {
+    return Nodes() == 1 ? 0 : NodeOfCpu(sched_getcpu());
+  }
+
+private:
+  static Topology Read() {
+    static constexpr const char *kNodesDir = "/sys/devices/system/node";
+
+    Topology res;
+    if (DIR *dir = opendir(kNodesDir)) {
+      while (dirent *entry = readdir(dir)) {
+        std::string_view name(entry->d_name);
+        if (name.substr(0, 4) != "node" || name.size() == 4 ||
+            name.find_first_not_of("0123456789", 4) != std::string_view::npos) {
+          continue;
+        }
+
+        size_t node = std::stoul(std::string(name.substr(4)));
+        std::ifstream fin(std::string(kNodesDir) + "/" + entry->d_name +
+                          "/cpulist");
+        std::string list;
+        std::getline(fin, list);
+
+        res.AddNode(node, ParseCpuList(list));
+      }
+      closedir(dir);
+    }
+
+    if (res.node_cpus_.empty()) {
+      std::vector<int> cpus;
+      for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); ++cpu) {
+        cpus.push_back(cpu);
+      }
+      res.AddNode(0, std::move(cpus));
+    }
+
+    return res;
+  }
+
+  void AddNode(size_t node, std::vector<int> cpus) {
+    if (node_cpus_.size() <= node) {
+      node_cpus_.resize(node + 1);
+    }
+    for (int cpu : cpus) {
+      if (cpu_node_.size() <= static_cast<size_t>(cpu)) {
+        cpu_node_.resize(cpu + 1, 0);
+      }
+      cpu_node_[cpu] = node;
+    }
+    node_cpus_[node] = std::move(cpus);
+  }
+
+  std::vector<std::vector<int>> node_cpus_;
+  std::vector<size_t> cpu_node_;
+};
+
+inline bool PinThread(pthread_t thread, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+}
+
+} // namespace topology
@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Trace events in the Chrome trace-event format, which chrome://tracing and
+// ui.perfetto.dev open. Every thread appends to its own ring buffer without
+// locks; Start(path) turns recording on, and the buffers are written out at
+// exit and on SIGINT/SIGTERM (then the signal is re-raised) or SIGUSR1 (the
+// process keeps running). A thread takes over the buffer of one which has
+// exited, so there are only as many buffers as threads alive at once. Until
+// Start every macro costs one relaxed load, with -DTRACE_DISABLED they
+// compile to nothing.
+//
+// Names are not copied, they have to be string literals.
+
+namespace trace {
+
+using Clock = std::chrono::steady_clock;
+
+// Every thread keeps its last kEventsPerThread events
+static constexpr size_t kEventsPerThread = size_t{1} << 15;
+
+struct Event {
+  const char *name;
+  uint64_t ts_ns;
+  uint64_t dur_ns;
+  int64_t value;
+  // 'X' span, 'C' counter, 'b' span written as an async 'b'/'e' pair
+  char phase;
+  bool has_value;
+  // Set by the buffer, it outlives the thread which recorded the event
+  int tid{0};
+};
+
+// Single producer ring. Snapshot may run concurrently with the owner and
+// drops the slots the owner could have been rewriting meanwhile.
+class ThreadBuffer {
+public:
+  ThreadBuffer() : events_(kEventsPerThread) {}
+
+  // Makes the calling thread the producer
+  void Own() { tid_ = ::syscall(SYS_gettid); }
+
+  void Push(const Event &event) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    auto &slot = events_[head % kEventsPerThread];
+    slot = event;
+    slot.tid = tid_;
+    head_.store(head + 1, std::memory_order_release);
+  }
+
+  std::vector<Event> Snapshot() const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = head > kEventsPerThread ? head - kEventsPerThread : 0;
+    std::vector<Event> events;
+    for (uint64_t i = first; i < head; ++i) {
+      events.push_back(events_[i % kEventsPerThread]);
+    }
+
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t after = head_.load(std::memory_order_relaxed);
+    uint64_t valid = after >= kEventsPerThread ? after - kEventsPerThread + 1 : 0;
+    if (valid > first) {
+      events.erase(events.begin(),
+                   events.begin() + std::min<uint64_t>(valid - first, events.size()));
+    }
+    return events;
+  }
+
+private:
+  int tid_{0};
+  std::vector<Event> events_;
+  std::atomic<uint64_t> head_{0};
+};
+
+class Tracer {
+public:
+  static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+
+  // Starts recording, the file is written at exit or on signal. Only the
+  // first call has an effect.
+  static void Start(const std::string &path) {
+    Tracer &tracer = Get();
+    std::unique_lock lock(tracer.mt_);
+    if (!tracer.path_.empty()) {
+      return;
+    }
+    tracer.path_ = path;
+    tracer.epoch_ = Clock::now();
+
+    if (::pipe2(signal_pipe_, O_CLOEXEC) == 0) {
+      std::thread(&Tracer::Flusher).detach();
+      struct sigaction action {};
+      action.sa_handler = &Tracer::OnSignal;
+      sigemptyset(&action.sa_mask);
+      for (int signo : {SIGINT, SIGTERM, SIGUSR1}) {
+        ::sigaction(signo, &action, nullptr);
+      }
+    }
+    std::atexit([] { Get().Flush(); });
+    enabled_.store(true);
+  }
+
+  static uint64_t Now() { return ToNs(Clock::now()); }
+
+  static uint64_t ToNs(Clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               time.time_since_epoch())
+        .count();
+  }
+
+  static void Record(const Event &event) { Local().Push(event); }
+
+  static void SetThreadName(const char *name) {
+    int tid = ::syscall(SYS_gettid);
+    Tracer &tracer = Get();
+    std::unique_lock lock(tracer.mt_);
+    tracer.names_[tid] = name;
+  }
+
+  // Writes everything recorded so far, may be called many times
+  void Flush() {
+    std::unique_lock lock(mt_);
+    std::FILE *file = std::fopen(path_.c_str(), "w");
+    if (file == nullptr) {
+      return;
+    }
+
+    int pid = ::getpid();
+    uint64_t epoch = ToNs(epoch_);
+    auto us = [](uint64_t ns) { return ns / 1000.0; };
+
+    std::fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    bool first = true;
+    auto separator = [&] {
+      std::fprintf(file, first ? "  " : ",\n  ");
+      first = false;
+    };
+
+    for (auto [tid, name] : names_) {
+      separator();
+      std::fprintf(file,
+                   "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                   "\"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                   pid, tid, name);
+    }
+
+    uint64_t async_id = 0;
+    for (auto &buffer : buffers_) {
+      for (auto &event : buffer->Snapshot()) {
+        if (event.ts_ns < epoch) {
+          continue;
+        }
+        separator();
+        std::fprintf(file,
+                     "{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": %d, "
+                     "\"tid\": %d, \"ts\": %.3f",
+                     event.name, event.phase, pid, event.tid,
+                     us(event.ts_ns - epoch));
+        if (event.phase == 'b') {
+          // Both halves are written together, so a pair is never cut by
+          // the ring
+          ++async_id;
+          std::fprintf(file,
+                       ", \"cat\": \"async\", \"id\": %llu},\n  "
+                       "{\"name\": \"%s\", \"ph\": \"e\", \"cat\": \"async\", "
+                       "\"id\": %llu, \"pid\": %d, \"tid\": %d, \"ts\": %.3f",
+                       static_cast<unsigned long long>(async_id), event.name,
+                       static_cast<unsigned long long>(async_id), pid, event.tid,
+                       us(event.ts_ns + event.dur_ns - epoch));
+        }
+        if (event.phase == 'X') {
+          std::fprintf(file, ", \"dur\": %.3f", us(event.dur_ns));
+        }
+        if (event.has_value) {
+          std::fprintf(file, ", \"args\": {\"value\": %lld}",
+                       static_cast<long long>(event.value));
+        }
+        std::fprintf(file, "}");
+      }
+    }
+    std::fprintf(file, "\n]}\n");
+    std::fclose(file);
+  }
+
+private:
+  static Tracer &Get() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  // Returns the buffer to the free list when its thread exits
+  struct Lease {
+    Lease() : buffer(Get().Acquire()) {}
+    ~Lease() { Get().Release(buffer); }
+    ThreadBuffer *buffer;
+  };
+
+  static ThreadBuffer &Local() {
+    thread_local Lease lease;
+    return *lease.buffer;
+  }
+
+  // Buffers stay registered after their threads exit, so events of
+  // finished threads are still written until a new owner overwrites them
+  ThreadBuffer *Acquire() {
+    std::unique_lock lock(mt_);
+    ThreadBuffer *buffer;
+    if (free_.empty()) {
+      buffers_.push_back(std::make_unique<ThreadBuffer>());
+      buffer = buffers_.back().get();
+    } else {
+      buffer = free_.back();
+      free_.pop_back();
+    }
+    buffer->Own();
+    return buffer;
+  }
+
+  void Release(ThreadBuffer *buffer) {
+    std::unique_lock lock(mt_);
+    free_.push_back(buffer);
+  }
+
+  // Only the write is async-signal-safe, the flusher thread does the rest
+  static void OnSignal(int signo) {
+    int saved = errno;
+    unsigned char byte = signo;
+    [[maybe_unused]] auto rc = ::write(signal_pipe_[1], &byte, 1);
+    errno = saved;
+  }
+
+  static void Flusher() {
+    while (true) {
+      unsigned char signo;
+      auto bytes = ::read(signal_pipe_[0], &signo, 1);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes <= 0) {
+        return;
+      }
+
+      Get().Flush();
+      if (signo != SIGUSR1) {
+        std::signal(signo, SIG_DFL);
+        std::raise(signo);
+      }
+    }
+  }
+
+  inline static std::atomic<bool> enabled_{false};
+  inline static int signal_pipe_[2]{-1, -1};
+
+  std::mutex mt_;
+  std::string path_;
+  Clock::time_point epoch_;
+  std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+  std::vector<ThreadBuffer *> free_;
+  std::map<int, const char *> names_;
+};
+
+inline bool Enabled() { return Tracer::Enabled(); }
+
+// Span from construction to destruction. A null name records nothing.
+class Scope {
+public:
+  explicit Scope(const char *name) : Scope(name, 0, false) {}
+
+  Scope(const char *name, int64_t value, bool has_value = true)
+      : name_(Enabled() ? name : nullptr), value_(value), has_value_(has_value) {
+    if (name_) {
+      start_ = Tracer::Now();
+    }
+  }
+
+  Scope(const Scope &) = delete;
+  Scope &operator=(const Scope &) = delete;
+
+  ~Scope() {
+    if (name_) {
+      Tracer::Record(
+          Event{name_, start_, Tracer::Now() - start_, value_, 'X', has_value_});
+    }
+  }
+
+private:
+  const char *name_;
+  int64_t value_;
+  bool has_value_;
+  uint64_t start_{0};
+};
+
+// Span which already ended, e.g. the time a task spent in a queue. It may
+// overlap spans the thread ran meanwhile, so it goes to an async track.
+inline void Span(const char *name, Clock::time_point start, Clock::time_point end) {
+  if (Enabled()) {
+    uint64_t ts = Tracer::ToNs(start);
+    Tracer::Record(Event{name, ts, Tracer::ToNs(end) - ts, 0, 'b', false});
+  }
+}
+
+inline void Counter(const char *name, int64_t value) {
+  if (Enabled()) {
+    Tracer::Record(Event{name, Tracer::Now(), 0, value, 'C', true});
+  }
+}
+
+inline void ThreadName(const char *name) {
+  if (Enabled()) {
+    Tracer::SetThreadName(name);
+  }
+}
+
+} // namespace trace
+
+#ifdef TRACE_DISABLED
+
+#define TRACE_SCOPE(name) ((void)0)
+#define TRACE_SCOPE_VALUE(name, value) ((void)0)
+#define TRACE_SCOPE_IF(condition, name, value) ((void)0)
+#define TRACE_SPAN(name, start, end) ((void)0)
+#define TRACE_COUNTER(name, value) ((void)0)
+#define TRACE_THREAD_NAME(name) ((void)0)
+
+#else
+
+#define TRACE_CONCAT_IMPL(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_IMPL(a, b)
+#define TRACE_SCOPE(name) ::trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+#define TRACE_SCOPE_VALUE(name, value)                                        \
+  ::trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(name, value)
+// Spans only what passes the condition, e.g. large operations of many
+#define TRACE_SCOPE_IF(condition, name, value)                                \
+  ::trace::Scope TRACE_CONCAT(trace_scope_, __LINE__)(                        \
+      ::trace::Enabled() && (condition) ? name : nullptr, value)
+#define TRACE_SPAN(name, start, end) ::trace::Span(name, start, end)
+#define TRACE_COUNTER(name, value) ::trace::Counter(name, value)
+#define TRACE_THREAD_NAME(name) ::trace::ThreadName(name)
+
+#endif
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include <csignal>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace data {
+
+// Kills commands which run longer than the timeout. Commands have to be
+// spawned into their own process group, so shell children die with it.
+class Watchdog {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit Watchdog(std::chrono::milliseconds timeout)
+      : timeout_(timeout), thread_(&Watchdog::Run, this) {}
+
+  Watchdog(const Watchdog &) = delete;
+  Watchdog &operator=(const Watchdog &) = delete;
+
+  ~Watchdog() {
+    {
+      std::unique_lock lock(mt_);
+      stop_ = true;
+    }
+    cv_.notify_one();
+    thread_.join();
+  }
+
+  // Returns an id for Release
+  uint64_t Watch(pid_t pid) {
+    int pid_fd = ::syscall(SYS_pidfd_open, pid, 0);
+    if (pid_fd >= 0) {
+      ::fcntl(pid_fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    std::unique_lock lock(mt_);
+    Entry entry{Clock::now() + timeout_, pid, pid_fd};
+    uint64_t id = next_id_++;
+    bool first = deadlines_.empty();
+    deadlines_.emplace(id, entry);
+    if (first) {
+      cv_.notify_one();
+    }
+    return id;
+  }
+
+  // Returns true if the command was killed. May be called after the command
+  // is reaped, such commands are never signalled.
+  bool Release(uint64_t id) {
+    std::unique_lock lock(mt_);
+    auto it = deadlines_.find(id);
+    if (it != deadlines_.end()) {
+      Close(it->second);
+      deadlines_.erase(it);
+      return false;
+    }
+    return killed_ids_.erase(id) > 0;
+  }
+
+  size_t Killed() const { return killed_.load(); }
+
+private:
+  struct Entry {
+    Clock::time_point deadline;
+    pid_t pid;
+    int pid_fd;
+  };
+
+  static void Close(const Entry &entry) {
+    if (entry.pid_fd >= 0) {
+      ::close(entry.pid_fd);
+    }
+  }
+
+  void Run() {
+    std::unique_lock lock(mt_);
+    while (!stop_) {
+      if (deadlines_.empty()) {
+        cv_.wait(lock);
+        continue;
+      }
+
+      auto it = deadlines_.begin();
+      if (Clock::now() < it->second.deadline) {
+        cv_.wait_until(lock, it->second.deadline);
+        continue;
+      }
+
+      Kill(it->second);
+      Close(it->second);
+      killed_ids_.insert(it->first);
+      killed_.fetch_add(1);
+      deadlines_.erase(it);
+    }
+  }
+
+  // The group id can not be reused while its leader is not reaped, the
+  // pidfd tells whether it is. Without pidfd only the leader is killed.
+  static void Kill(const Entry &entry) {
+    if (entry.pid_fd < 0) {
+      ::kill(entry.pid, SIGKILL);
+      return;
+    }
+    if (::syscall(SYS_pidfd_send_signal, entry.pid_fd, 0, nullptr, 0) == 0) {
+      ::kill(-entry.pid, SIGKILL);
+    }
+  }
+
+  const std::chrono::milliseconds timeout_;
+
+  std::mutex mt_;
+  std::condition_variable cv_;
+  bool stop_{false};
+  uint64_t next_id_{0};
+  // The timeout is the same for all, so ids are ordered by deadline too
+  std::map<uint64_t, Entry> deadlines_;
+  std::set<uint64_t> killed_ids_;
+  std::atomic<size_t> killed_{0};
+
+  std::thread thread_;
+};
+
+} // namespace data
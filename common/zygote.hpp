@@ -0,0 +1,280 @@
+#pragma once
+
+#include <array>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <future>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "spawn.hpp"
+
+namespace data {
+
+// Small helper process which spawns commands on behalf of the parent. It is
+// forked once, while the parent is still single threaded and small, so the
+// cost of every later spawn does not depend on the parent's heap or number
+// of threads. Requests and replies are datagrams on a SOCK_SEQPACKET pair,
+// stdout pipes come back through SCM_RIGHTS and exit statuses are reported
+// by the helper, which is the actual parent of the commands.
+class Zygote {
+public:
+  // Has to be created before any other thread is started
+  Zygote() {
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+      throw std::runtime_error("Cannot create zygote socket");
+    }
+
+    helper_ = ::fork();
+    if (helper_ < 0) {
+      throw std::runtime_error("Cannot fork zygote");
+    }
+    if (helper_ == 0) {
+      ::close(fds[0]);
+      Serve(fds[1]);
+      ::_exit(0);
+    }
+
+    ::close(fds[1]);
+    sock_ = fds[0];
+    reader_ = std::thread(&Zygote::Read, this);
+  }
+
+  Zygote(const Zygote &) = delete;
+  Zygote &operator=(const Zygote &) = delete;
+
+  // The helper exits on EOF, commands still running are left to init
+  ~Zygote() {
+    ::shutdown(sock_, SHUT_RDWR);
+    reader_.join();
+    ::close(sock_);
+    WaitChild(helper_);
+  }
+
+  // Same as SpawnCommand, but done by the helper. The child can be killed
+  // directly, but has to be waited with Wait.
+  ChildProcess Spawn(const std::string &cmd, bool own_group = false) {
+    std::promise<ChildProcess> promise;
+    auto future = promise.get_future();
+
+    uint64_t id;
+    {
+      std::unique_lock lock(mt_);
+      if (dead_) {
+        throw std::runtime_error("Zygote has exited");
+      }
+      id = next_id_++;
+      spawning_.emplace(id, std::move(promise));
+    }
+
+    Request request{id, own_group, {}};
+    size_t size = std::min(cmd.size(), sizeof(request.cmd));
+    std::memcpy(request.cmd, cmd.data(), size);
+    if (cmd.size() > sizeof(request.cmd) ||
+        ::send(sock_, &request, offsetof(Request, cmd) + size, MSG_NOSIGNAL) < 0) {
+      std::unique_lock lock(mt_);
+      spawning_.erase(id);
+      throw std::runtime_error("Cannot send command to zygote");
+    }
+
+    return future.get();
+  }
+
+  // Same as WaitChild for children started with Spawn
+  int Wait(pid_t pid, rusage *usage = nullptr) {
+    std::unique_lock lock(mt_);
+    exited_cv_.wait(lock, [&] { return dead_ || exited_.count(pid) > 0; });
+
+    auto it = exited_.find(pid);
+    if (it == exited_.end()) {
+      return -1;
+    }
+    if (usage) {
+      *usage = it->second.usage;
+    }
+    int status = it->second.status;
+    exited_.erase(it);
+    return status;
+  }
+
+private:
+  struct Request {
+    uint64_t id;
+    bool own_group;
+    char cmd[32 * 1024];
+  };
+
+  struct Reply {
+    enum Type : uint32_t { kSpawned, kFailed, kExited } type;
+    uint64_t id;
+    pid_t pid;
+    int status;
+    rusage usage;
+  };
+
+  struct Exit {
+    int status;
+    rusage usage;
+  };
+
+  // Helper side, single threaded
+  static void Serve(int sock) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    ::sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sig_fd = ::signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+
+    static Request request;
+    std::array<pollfd, 2> fds{pollfd{sock, POLLIN, 0}, pollfd{sig_fd, POLLIN, 0}};
+
+    while (true) {
+      if (::poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
+      }
+
+      if (fds[1].revents & POLLIN) {
+        signalfd_siginfo info;
+        while (::read(sig_fd, &info, sizeof(info)) > 0)
+          ;
+        ReportExited(sock);
+      }
+
+      if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+        auto bytes = ::recv(sock, &request, sizeof(request), 0);
+        if (bytes <= 0) {
+          return;
+        }
+        std::string cmd(request.cmd, bytes - offsetof(Request, cmd));
+        SendSpawned(sock, request.id, cmd, request.own_group);
+      }
+    }
+  }
+
+  static void SendSpawned(int sock, uint64_t id, const std::string &cmd,
+                          bool own_group) {
+    Reply reply{Reply::kFailed, id, -1, 0, {}};
+    ChildProcess child;
+    try {
+      child = SpawnCommand(cmd, own_group);
+      reply.type = Reply::kSpawned;
+      reply.pid = child.pid;
+    } catch (const std::exception &) {
+    }
+
+    iovec iov{&reply, sizeof(reply)};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+    if (child.out_fd >= 0) {
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      cmsg->cmsg_level = SOL_SOCKET;
+      cmsg->cmsg_type = SCM_RIGHTS;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(cmsg), &child.out_fd, sizeof(int));
+    }
+
+    while (::sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 && errno == EINTR)
+      ;
+    if (child.out_fd >= 0) {
+      ::close(child.out_fd);
+    }
+  }
+
+  static void ReportExited(int sock) {
+    Reply reply{Reply::kExited, 0, -1, 0, {}};
+    while ((reply.pid = ::wait4(-1, &reply.status, WNOHANG, &reply.usage)) > 0) {
+      while (::send(sock, &reply, sizeof(reply), MSG_NOSIGNAL) < 0 &&
+             errno == EINTR)
+        ;
+    }
+  }
+
+  // Parent side, dispatches replies to waiting Spawn and Wait calls
+  void Read() {
+    while (true) {
+      Reply reply;
+      iovec iov{&reply, sizeof(reply)};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+      msghdr msg{};
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+
+      auto bytes = ::recvmsg(sock_, &msg, MSG_CMSG_CLOEXEC);
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+      if (bytes != sizeof(reply)) {
+        break;
+      }
+
+      std::unique_lock lock(mt_);
+      if (reply.type == Reply::kExited) {
+        exited_[reply.pid] = Exit{reply.status, reply.usage};
+        exited_cv_.notify_all();
+        continue;
+      }
+
+      auto it = spawning_.find(reply.id);
+      if (it == spawning_.end()) {
+        continue;
+      }
+
+      cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+      if (reply.type == Reply::kSpawned && cmsg && cmsg->cmsg_type == SCM_RIGHTS) {
+        int fd;
+        std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+        it->second.set_value(ChildProcess{reply.pid, fd});
+      } else {
+        it->second.set_exception(std::make_exception_ptr(
+            std::runtime_error("Zygote cannot spawn command")));
+      }
+      spawning_.erase(it);
+    }
+
+    std::unique_lock lock(mt_);
+    dead_ = true;
+    for (auto &[id, promise] : spawning_) {
+      promise.set_exception(
+          std::make_exception_ptr(std::runtime_error("Zygote has exited")));
+    }
+    spawning_.clear();
+    exited_cv_.notify_all();
+  }
+
+  pid_t helper_{-1};
+  int sock_{-1};
+  std::thread reader_;
+
+  std::mutex mt_;
+  std::condition_variable exited_cv_;
+  bool dead_{false};
+  uint64_t next_id_{0};
+  std::map<uint64_t, std::promise<ChildProcess>> spawning_;
+  std::map<pid_t, Exit> exited_;
+};
+
+} // namespace data
@@ -0,0 +1,441 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <common/mapped_file.hpp>
+#include <common/pool_metrics.hpp>
+#include <common/timer_wheel.hpp>
+
+namespace data {
+
+// Record of the schedule without its command text: the command stays in the
+// mapped file and is copied only when the record is dispatched.
+struct RecordRef {
+  uint64_t delay_ms;
+  uint64_t offset;
+  uint32_t size;
+};
+
+// Sorted runs of records in one anonymous temporary file. The parser
+// appends runs, the dispatcher reads them back block by block.
+class RunFile {
+public:
+  explicit RunFile(const std::string &dir) {
+    std::string path = dir + "/schedule_runs.XXXXXX";
+    fd_ = ::mkostemp(path.data(), O_CLOEXEC);
+    if (fd_ < 0) {
+      throw std::runtime_error("Cannot create a run file in " + dir);
+    }
+    ::unlink(path.c_str());
+  }
+
+  RunFile(const RunFile &) = delete;
+  RunFile &operator=(const RunFile &) = delete;
+
+  ~RunFile() { ::close(fd_); }
+
+  // Parser only. Returns the index of the first appended record.
+  uint64_t Append(const std::vector<RecordRef> &records) {
+    uint64_t first = size_;
+    auto *data = reinterpret_cast<const char *>(records.data());
+    size_t bytes = records.size() * sizeof(RecordRef);
+    for (size_t done = 0; done < bytes;) {
+      auto rc = ::pwrite(fd_, data + done, bytes - done,
+                         size_ * sizeof(RecordRef) + done);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc < 0) {
+        throw std::runtime_error("Cannot write schedule runs");
+      }
+      done += rc;
+    }
+    size_ += records.size();
+    return first;
+  }
+
+  // Records have to be appended already
+  void Read(uint64_t first, size_t count, std::vector<RecordRef> &out) const {
+    out.resize(count);
+    auto *data = reinterpret_cast<char *>(out.data());
+    size_t bytes = count * sizeof(RecordRef);
+    for (size_t done = 0; done < bytes;) {
+      auto rc = ::pread(fd_, data + done, bytes - done,
+                        first * sizeof(RecordRef) + done);
+      if (rc < 0 && errno == EINTR) {
+        continue;
+      }
+      if (rc <= 0) {
+        throw std::runtime_error("Cannot read schedule runs");
+      }
+      done += rc;
+    }
+  }
+
+private:
+  int fd_{-1};
+  uint64_t size_{0};
+};
+
+// Parses "<delay> <command>" lines of the mapped file on a separate thread,
+// so dispatch starts as soon as the first records are parsed. Delays are
+// seconds with up to millisecond fraction ("1.5").
+//
+// Memory does not grow with the file: the parser sorts chunks of records
+// and spills them as runs into a temporary file, the dispatcher merges the
+// runs through a heap of their heads and keeps one block of every run.
+// Only a window of the merged records waits in a timer wheel with
+// millisecond ticks; the dispatcher sleeps on a CLOCK_MONOTONIC timerfd
+// armed for the next expiry and an eventfd signalled by the parser.
+class Schedule {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  Schedule(const std::string &path, Clock::time_point start,
+           const std::string &spill_dir = "/tmp")
+      : file_(path), start_(start), runs_(spill_dir) {
+    timer_fd_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    parsed_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (timer_fd_ < 0 || parsed_fd_ < 0) {
+      throw std::runtime_error("Cannot create schedule timers");
+    }
+    parser_ = std::thread(&Schedule::Parse, this);
+  }
+
+  Schedule(const Schedule &) = delete;
+  Schedule &operator=(const Schedule &) = delete;
+
+  ~Schedule() {
+    {
+      std::unique_lock lock(mt_);
+      stop_ = true;
+    }
+    parser_.join();
+    ::close(timer_fd_);
+    ::close(parsed_fd_);
+  }
+
+  // Blocks until some records are due and returns all of them at once in
+  // the order of delays, ties in the order of the file. Returns false when
+  // the file is exhausted.
+  bool Next(std::vector<RecordRef> &due) {
+    due.clear();
+    while (true) {
+      uint64_t now = Now();
+      bool parsed = TakeParsed(now);
+      wheel_.Advance(now, due);
+      if (!due.empty()) {
+        // Records of one tick may have been taken from the runs at
+        // different times, offsets restore the order of the file
+        std::sort(due.begin(), due.end(),
+                  [](const RecordRef &lhs, const RecordRef &rhs) {
+                    return std::pair(lhs.delay_ms, lhs.offset) <
+                           std::pair(rhs.delay_ms, rhs.offset);
+                  });
+        return true;
+      }
+      if (parsed && wheel_.Size() == 0) {
+        return false;
+      }
+
+      auto expiry = wheel_.NextExpiry();
+      if (!heads_.empty()) {
+        expiry = std::min(expiry.value_or(heads_.top().first), heads_.top().first);
+      }
+      Sleep(expiry);
+    }
+  }
+
+  Clock::time_point Due(const RecordRef &record) const {
+    return start_ + std::chrono::milliseconds(record.delay_ms);
+  }
+
+  std::string_view Command(const RecordRef &record) const {
+    return file_.Data().substr(record.offset, record.size);
+  }
+
+private:
+  // Runs start small, so the first records are dispatched right away, and
+  // grow up to kMaxRun records. kMaxRun bounds the parser's memory, and the
+  // number of runs, each holding a kBlock buffer, stays at N / kMaxRun.
+  static constexpr size_t kFirstRun = 4096;
+  static constexpr size_t kMaxRun = size_t{1} << 18;
+  static constexpr size_t kBlock = 1024;
+  // Merged records taken into the wheel ahead of their time
+  static constexpr size_t kWindow = 4096;
+
+  struct Run {
+    uint64_t first;
+    uint64_t size;
+  };
+
+  // Reads a run back one block at a time
+  class RunCursor {
+  public:
+    RunCursor(const RunFile &file, Run run) : file_(&file), run_(run) { Fill(); }
+
+    bool Done() const { return pos_ == block_.size(); }
+    const RecordRef &Head() const { return block_[pos_]; }
+
+    void Pop() {
+      if (++pos_ == block_.size()) {
+        Fill();
+      }
+    }
+
+  private:
+    void Fill() {
+      size_t count = std::min<uint64_t>(kBlock, run_.size - read_);
+      if (count == 0) {
+        block_ = {};
+        pos_ = 0;
+        return;
+      }
+      file_->Read(run_.first + read_, count, block_);
+      read_ += count;
+      pos_ = 0;
+    }
+
+    const RunFile *file_;
+    Run run_;
+    uint64_t read_{0};
+    std::vector<RecordRef> block_;
+    size_t pos_{0};
+  };
+
+  uint64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                                 start_)
+        .count();
+  }
+
+  // Merges runs published by the parser into the wheel, returns true once
+  // the parser is done and every record is in the wheel
+  bool TakeParsed(uint64_t now) {
+    std::vector<Run> parsed;
+    bool done;
+    {
+      std::unique_lock lock(mt_);
+      if (error_) {
+        std::rethrow_exception(error_);
+      }
+      parsed.swap(parsed_);
+      done = done_;
+    }
+    for (auto &run : parsed) {
+      cursors_.emplace_back(runs_, run);
+      heads_.emplace(cursors_.back().Head().delay_ms, cursors_.size() - 1);
+    }
+
+    // A full window takes only due records: a new run may start before
+    // what is already in the wheel
+    while (!heads_.empty() &&
+           (wheel_.Size() < kWindow || heads_.top().first <= now)) {
+      auto [delay, index] = heads_.top();
+      heads_.pop();
+      RunCursor &cursor = cursors_[index];
+      wheel_.Add(delay, cursor.Head());
+
+      cursor.Pop();
+      if (!cursor.Done()) {
+        heads_.emplace(cursor.Head().delay_ms, index);
+      }
+    }
+    return done && heads_.empty();
+  }
+
+  void Sleep(std::optional<uint64_t> expiry) {
+    itimerspec spec{};
+    if (expiry) {
+      auto due = start_ + std::chrono::milliseconds(*expiry);
+      auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    due.time_since_epoch())
+                    .count();
+      spec.it_value.tv_sec = ns / 1000000000;
+      spec.it_value.tv_nsec = std::max<long>(ns % 1000000000, 1);
+    }
+    ::timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+    std::array<pollfd, 2> fds{pollfd{timer_fd_, POLLIN, 0},
+                              pollfd{parsed_fd_, POLLIN, 0}};
+    while (::poll(fds.data(), fds.size(), -1) < 0 && errno == EINTR)
+      ;
+
+    uint64_t value;
+    [[maybe_unused]] auto rc = ::read(timer_fd_, &value, sizeof(value));
+    rc = ::read(parsed_fd_, &value, sizeof(value));
+  }
+
+  void Parse() {
+    std::string_view data = file_.Data();
+    std::vector<RecordRef> run;
+    size_t run_limit = kFirstRun;
+    size_t pos = 0;
+
+    while (true) {
+      auto record = ParseRecord(data, pos);
+      if (record) {
+        run.push_back(*record);
+      }
+      if (!record || run.size() == run_limit) {
+        // Runs go in file order and are sorted stably, so the merge keeps
+        // ties in the order of the file
+        std::stable_sort(run.begin(), run.end(),
+                         [](const RecordRef &lhs, const RecordRef &rhs) {
+                           return lhs.delay_ms < rhs.delay_ms;
+                         });
+        std::optional<Run> spilled;
+        std::exception_ptr error;
+        try {
+          if (!run.empty()) {
+            spilled = Run{runs_.Append(run), run.size()};
+          }
+        } catch (...) {
+          error = std::current_exception();
+        }
+
+        bool done;
+        {
+          std::unique_lock lock(mt_);
+          if (spilled) {
+            parsed_.push_back(*spilled);
+          }
+          error_ = error;
+          done = done_ = !record || stop_ || error;
+        }
+        run.clear();
+        run_limit = std::min(run_limit * 2, kMaxRun);
+
+        uint64_t one = 1;
+        [[maybe_unused]] auto rc = ::write(parsed_fd_, &one, sizeof(one));
+        if (done) {
+          return;
+        }
+      }
+    }
+  }
+
+  // Same as `stream >> delay` followed by getline: leading whitespace is
+  // skipped, the command is the rest of the line. Fraction digits past
+  // milliseconds are ignored.
+  static std::optional<RecordRef> ParseRecord(std::string_view data,
+                                              size_t &pos) {
+    while (pos < data.size() && std::isspace(static_cast<unsigned char>(data[pos]))) {
+      ++pos;
+    }
+
+    auto digit = [&] {
+      return pos < data.size() && data[pos] >= '0' && data[pos] <= '9';
+    };
+
+    uint64_t delay_ms = 0;
+    size_t digits = pos;
+    for (; digit(); ++pos) {
+      delay_ms = delay_ms * 10 + (data[pos] - '0');
+    }
+    if (pos == digits) {
+      return std::nullopt;
+    }
+
+    delay_ms *= 1000;
+    if (pos < data.size() && data[pos] == '.') {
+      ++pos;
+      for (uint64_t scale = 100; digit(); ++pos, scale /= 10) {
+        delay_ms += (data[pos] - '0') * scale;
+      }
+    }
+
+    size_t end = std::min(data.find('\n', pos), data.size());
+    RecordRef record{delay_ms, pos, static_cast<uint32_t>(end - pos)};
+    pos = end;
+    return record;
+  }
+
+  const MappedFile file_;
+  const Clock::time_point start_;
+  RunFile runs_;
+  int timer_fd_{-1};
+  int parsed_fd_{-1};
+
+  // Dispatcher only
+  TimerWheel<RecordRef> wheel_;
+  std::vector<RunCursor> cursors_;
+  // (delay of the head, cursor), the earliest on top. Cursors go in file
+  // order, so equal delays keep it.
+  std::priority_queue<std::pair<uint64_t, size_t>,
+                      std::vector<std::pair<uint64_t, size_t>>, std::greater<>>
+      heads_;
+
+  std::mutex mt_;
+  bool done_{false};
+  bool stop_{false};
+  std::exception_ptr error_;
+  std::vector<Run> parsed_;
+
+  std::thread parser_;
+};
+
+// How late records were handed to the pool. Every record is written to the
+// file ("-" is stderr) as "delay_ms,lateness_us,cmd", the summary goes to
+// PrintSummary.
+class LatenessReporter {
+public:
+  explicit LatenessReporter(const std::string &path) {
+    if (path != "-") {
+      file_ = std::make_unique<std::ofstream>(path);
+    }
+    Out() << "delay_ms,lateness_us,cmd\n";
+  }
+
+  void Add(const RecordRef &record, std::string_view cmd,
+           Schedule::Clock::duration lateness) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(lateness)
+                  .count();
+    us = std::max<decltype(us)>(us, 0);
+    histogram_.Record(us);
+    Out() << record.delay_ms << "," << us << "," << cmd << "\n";
+  }
+
+  void PrintSummary(std::ostream &out) {
+    Out().flush();
+    auto snapshot = histogram_.Get();
+    out << "lateness: records=" << snapshot.count
+        << " avg_us=" << snapshot.Average()
+        << " p50_us<=" << snapshot.Percentile(50)
+        << " p99_us<=" << snapshot.Percentile(99) << std::endl;
+  }
+
+private:
+  std::ostream &Out() { return file_ ? *file_ : std::cerr; }
+
+  std::unique_ptr<std::ofstream> file_;
+  thread_pool::Histogram histogram_;
+};
+
+} // namespace data
@@ -0,0 +1,90 @@
+#include <common/timer_wheel.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <set>
+#include <vector>
+
+namespace {
+
+// Up to 2^40 ticks ahead: every level and the overflow beyond 2^32
+uint64_t RandomExpiry(uint64_t now) {
+  uint64_t range = uint64_t{1} << (8 * (1 + rand() % 5));
+  return now + 1 + (static_cast<uint64_t>(rand()) * rand()) % range;
+}
+
+} // namespace
+
+int main() {
+  // Case 1: NextExpiry is never later than the earliest timer, while timers
+  // are added between advances to all levels and the overflow
+  {
+    srand(5);
+    for (int round = 0; round < 2000; ++round) {
+      uint64_t now = rand() % 100000;
+      data::TimerWheel<int> wheel(now);
+      std::multiset<uint64_t> timers;
+      auto add = [&](int count) {
+        for (int i = 0; i < count; ++i) {
+          uint64_t expiry = RandomExpiry(now);
+          wheel.Add(expiry, i);
+          timers.insert(expiry);
+        }
+      };
+
+      add(20);
+      for (int step = 0; step < 30 && !timers.empty(); ++step) {
+        auto next = wheel.NextExpiry();
+        assert(next && *next <= *timers.begin());
+
+        std::vector<int> expired;
+        now = *next;
+        wheel.Advance(now, expired);
+        auto last = timers.upper_bound(now);
+        assert(expired.size() == static_cast<size_t>(std::distance(timers.begin(), last)));
+        timers.erase(timers.begin(), last);
+        add(3);
+      }
+    }
+  }
+
+  std::cout << "Case 1 completed" << std::endl;
+
+  // Case 2: a timer in the overflow is due before a top level slot which
+  // wraps past the next rotation
+  {
+    data::TimerWheel<int> wheel(0);
+    std::vector<int> expired;
+    wheel.Add((uint64_t{1} << 32) + 1, 0);
+    wheel.Advance(uint64_t{250} << 24, expired);
+    wheel.Add((uint64_t{1} << 32) + (uint64_t{249} << 24), 1);
+
+    assert(*wheel.NextExpiry() <= (uint64_t{1} << 32) + 1);
+    while (expired.size() < 2) {
+      wheel.Advance(*wheel.NextExpiry(), expired);
+    }
+    assert((expired == std::vector<int>{0, 1}));
+  }
+
+  std::cout << "Case 2 completed" << std::endl;
+
+  // Case 3: a timer placed on level 1 long ago is due before a new one on
+  // level 0
+  {
+    data::TimerWheel<int> wheel(0);
+    std::vector<int> expired;
+    wheel.Add(257, 0);
+    wheel.Advance(250, expired);
+    wheel.Add(300, 1);
+
+    assert(*wheel.NextExpiry() <= 257);
+    while (expired.size() < 2) {
+      wheel.Advance(*wheel.NextExpiry(), expired);
+    }
+    assert((expired == std::vector<int>{0, 1}));
+  }
+
+  std::cout << "Case 3 completed" << std::endl;
+}
@@ -1,96 +1,164 @@
 #include <chrono>
-#include <fstream>
 #include <iostream>
-#include <optional>
-#include <queue>
 #include <string>
+#include <vector>
 
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <common/flags.hpp>
 #include <common/thread_pool.hpp>
 #include <common/command.hpp>
 
-namespace chrono = std::chrono;
-using TimePoint = chrono::system_clock::time_point;
-
-namespace data {
-
-struct Item final : public Command {
-  size_t delay;
-
-  struct ItemMore {
-    bool operator()(const Item &lhs, const Item &rhs) {
-      return lhs.delay > rhs.delay;
-    }
-  };
-};
-
-using Container = std::vector<Item>;
+#include "schedule.hpp"
 
-} // namespace data
+namespace chrono = std::chrono;
+using TimePoint = data::Schedule::Clock::time_point;
 
 namespace {
 
-static constexpr size_t kThreadPoolSize{10};
+// Commands mostly sleep in popen, so let the pool grow while they block
+static constexpr thread_pool::ThreadPoolOptions kPoolOptions{
+    .min_threads = 2, .max_threads = 64, .keep_alive = chrono::seconds(5)};
 
-std::string ExtractFilename(int argc, char *argv[]) {
-  if (argc != 2) {
+std::string ExtractFilename(const cli::Flags &flags) {
+  if (flags.Positional().size() != 1) {
     throw std::runtime_error("wrong args amount");
   }
 
-  return std::string(argv[1]);
-}
-
-std::optional<data::Item> ExtractRecord(std::istream &stream) {
-  data::Item res;
-
-  if (stream >> res.delay) {
-    std::getline(stream, res.cmd);
-    return res;
-  }
-
-  return std::nullopt;
+  return flags.Positional()[0];
 }
 
 } // namespace
 
-using Queue =
-    std::priority_queue<data::Item, data::Container, data::Item::ItemMore>;
-
 int main(int argc, char *argv[]) {
-  TimePoint start_time = chrono::system_clock::now();
+  TimePoint start_time = data::Schedule::Clock::now();
+
+  cli::Flags flags(argc, argv);
+  auto filename = ExtractFilename(flags);
+
+  // --zygote spawns commands from a helper forked here, before any thread
+  // is started
+  std::unique_ptr<data::Zygote> zygote;
+  if (flags.Has("zygote")) {
+    zygote = std::make_unique<data::Zygote>();
+    data::CommandLauncher::SetZygote(zygote.get());
+    data::CommandLauncher::SetBackend(data::LaunchBackend::kZygote);
+  }
 
-  std::ifstream fin(ExtractFilename(argc, argv));
+  // --trace=PATH records spans of tasks, spawns and waits and writes them
+  // as Chrome trace JSON at exit or on SIGINT/SIGTERM/SIGUSR1
+  if (auto path = flags.Get("trace")) {
+    trace::Tracer::Start(*path);
+  }
 
-  thread_pool::ThreadPool<data::CommandLauncher> tp{
-      kThreadPoolSize, thread_pool::OverflowPolicy::kAllow};
-  Queue records;
+  // --output-order=completion|submission writes every task's lines as one
+  // record from a single writer thread
+  std::unique_ptr<data::OutputWriter> writer;
+  if (auto order = flags.Get("output-order")) {
+    writer = std::make_unique<data::OutputWriter>(
+        STDOUT_FILENO, *order == "submission" ? data::OutputOrder::kSubmission
+                                              : data::OutputOrder::kCompletion);
+    data::CommandLauncher::SetWriter(writer.get());
+  }
 
-  while (auto it = ExtractRecord(fin)) {
-    records.emplace(*it);
+  // --stream forwards output while commands run, --stream-tail=N also
+  // repeats last N bytes of it when the command finishes
+  if (flags.Has("stream") || flags.Has("stream-tail")) {
+    data::OutputOptions output;
+    output.mode = flags.Has("stream-tail") ? data::OutputMode::kStreamTail
+                                           : data::OutputMode::kStream;
+    output.tail_limit = flags.GetNumber("stream-tail", output.tail_limit);
+    data::CommandLauncher::SetOutput(output);
   }
 
-  std::cout << "Strat process records" << std::endl;
+  // --stats=PATH writes resource usage of every command (csv or
+  // --stats-format=jsonl) and prints percentiles at exit
+  std::unique_ptr<data::StatsReporter> stats;
+  if (auto path = flags.Get("stats")) {
+    stats = std::make_unique<data::StatsReporter>(
+        *path, flags.Get("stats-format") == "jsonl" ? data::StatsFormat::kJsonl
+                                                    : data::StatsFormat::kCsv);
+    data::CommandLauncher::SetStats(stats.get());
+  }
 
-  while (!records.empty()) {
-    std::unique_ptr<data::Item> it =
-        std::make_unique<data::Item>(std::move(records.top()));
+  // --cache=DIR reuses results of identical commands for --cache-ttl
+  // seconds, --cache-env makes the environment a part of the key
+  std::unique_ptr<data::ResultCache> cache;
+  if (auto dir = flags.Get("cache")) {
+    cache = std::make_unique<data::ResultCache>(data::CacheOptions{
+        .dir = *dir,
+        .ttl = std::chrono::seconds(flags.GetNumber("cache-ttl", 3600)),
+        .fingerprint_env = flags.Has("cache-env")});
+    data::CommandLauncher::SetResultCache(cache.get());
+  }
 
-    TimePoint expected_time = start_time + chrono::seconds(it->delay);
+  // --reactor[=N]: N reactor threads collect the output of all commands
+  std::unique_ptr<data::Reactor> reactor;
+  if (flags.Has("reactor")) {
+    data::Reactor::WaitFunction wait;
+    if (zygote) {
+      wait = [&zygote](pid_t pid, rusage *usage) {
+        return zygote->Wait(pid, usage);
+      };
+    }
+    reactor = std::make_unique<data::Reactor>(flags.GetNumber("reactor", 1),
+                                              std::move(wait));
+    data::CommandLauncher::SetReactor(reactor.get());
+  }
 
-    TimePoint now_time = chrono::system_clock::now();
+  thread_pool::ThreadPool<data::CommandLauncher> tp{
+      kPoolOptions, thread_pool::OverflowPolicy::kAllow};
+
+  // --metrics=PATH dumps pool metrics to the file, "-" means stderr
+  std::unique_ptr<thread_pool::MetricsReporter> metrics;
+  if (auto path = flags.Get("metrics")) {
+    metrics = std::make_unique<thread_pool::MetricsReporter>(
+        [&tp] { return tp.GetMetrics(); }, *path,
+        chrono::milliseconds(flags.GetNumber("metrics-interval", 1000)));
+  }
+  // --lateness=PATH writes how late every record was dispatched
+  std::unique_ptr<data::LatenessReporter> lateness;
+  if (auto path = flags.Get("lateness")) {
+    lateness = std::make_unique<data::LatenessReporter>(*path);
+  }
 
-    if (now_time <= expected_time) {
-      auto delta = expected_time - now_time;
-      usleep(chrono::duration_cast<chrono::microseconds>(delta).count());
-    }
+  // Parsing goes on while the first records are already dispatched. Sorted
+  // runs of parsed records are spilled into --spill-dir (/tmp by default).
+  data::Schedule schedule(filename, start_time,
+                          flags.Get("spill-dir").value_or("/tmp"));
 
-    auto time = data::GetTime();
-    tp.AddTask(data::CommandLauncher(std::move(it)));
+  std::cout << "Strat process records" << std::endl;
 
-    records.pop();
+  std::vector<data::RecordRef> due;
+  std::vector<data::CommandLauncher> batch;
+  while (schedule.Next(due)) {
+    batch.clear();
+    for (auto &record : due) {
+      batch.emplace_back(std::make_unique<data::Command>(
+          std::string(schedule.Command(record))));
+    }
+    tp.AddTasks(batch.begin(), batch.end());
+
+    if (lateness) {
+      auto now = data::Schedule::Clock::now();
+      for (auto &record : due) {
+        lateness->Add(record, schedule.Command(record),
+                      now - schedule.Due(record));
+      }
+    }
   }
 
+  // Let the metrics reporter dump the final state
+  tp.WaitForIdle();
+  if (reactor) {
+    reactor->WaitForAll();
+  }
+  if (stats) {
+    stats->PrintSummary(std::cerr);
+  }
+  if (lateness) {
+    lateness->PrintSummary(std::cerr);
+  }
   return 0;
 }
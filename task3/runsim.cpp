@@ -1,33 +1,224 @@
+#include <algorithm>
+#include <array>
 #include <iostream>
 #include <string>
+#include <vector>
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <cerrno>
 
+#include <common/admission.hpp>
+#include <common/flags.hpp>
 #include <common/thread_pool.hpp>
 #include <common/command.hpp>
 
+namespace {
+
+// Reads stdin by whole chunks, so every burst of lines which is already
+// available goes to the pool as one batch instead of line by line.
+class LineReader {
+public:
+  explicit LineReader(int fd) : fd_(fd) {}
+
+  // Returns false on EOF when there are no more lines left.
+  bool ReadBatch(std::vector<std::string> &lines) {
+    lines.clear();
+
+    while (lines.empty()) {
+      auto bytes = ::read(fd_, buffer_.data(), buffer_.size());
+      if (bytes < 0 && errno == EINTR) {
+        continue;
+      }
+
+      if (bytes <= 0) {
+        if (!tail_.empty()) {
+          lines.emplace_back(std::move(tail_));
+          tail_.clear();
+        }
+        return !lines.empty();
+      }
+
+      const char *cur = buffer_.data();
+      const char *end = cur + bytes;
+      while (cur != end) {
+        const char *eol = std::find(cur, end, '\n');
+        tail_.append(cur, eol);
+        if (eol == end) {
+          break;
+        }
+
+        lines.emplace_back(std::move(tail_));
+        tail_.clear();
+        cur = eol + 1;
+      }
+    }
+
+    return true;
+  }
+
+private:
+  int fd_;
+  std::array<char, 64 * 1024> buffer_;
+  std::string tail_;
+};
+
+} // namespace
+
 int main(int argc, char* argv[]) {
+  cli::Flags flags(argc, argv);
   size_t threads = 0;
 
   try {
-    threads = std::stoul(argv[1]);
+    threads = std::stoul(flags.Positional().at(0));
   } catch (const std::exception &ex) {
     std::cerr << "Cannot parse number of threads " << ex.what() << std::endl;
     return 0;
   }
 
+  // --zygote spawns commands from a helper forked here, before any thread
+  // is started
+  std::unique_ptr<data::Zygote> zygote;
+  if (flags.Has("zygote")) {
+    zygote = std::make_unique<data::Zygote>();
+    data::CommandLauncher::SetZygote(zygote.get());
+    data::CommandLauncher::SetBackend(data::LaunchBackend::kZygote);
+  }
+
+  // --trace=PATH records spans of tasks, spawns and waits and writes them
+  // as Chrome trace JSON at exit or on SIGINT/SIGTERM/SIGUSR1
+  if (auto path = flags.Get("trace")) {
+    trace::Tracer::Start(*path);
+  }
+
+  // --output-order=completion|submission writes every task's lines as one
+  // record from a single writer thread
+  std::unique_ptr<data::OutputWriter> writer;
+  if (auto order = flags.Get("output-order")) {
+    writer = std::make_unique<data::OutputWriter>(
+        STDOUT_FILENO, *order == "submission" ? data::OutputOrder::kSubmission
+                                              : data::OutputOrder::kCompletion);
+    data::CommandLauncher::SetWriter(writer.get());
+  }
+
+  // --stream forwards output while commands run, --stream-tail=N also
+  // repeats last N bytes of it when the command finishes
+  if (flags.Has("stream") || flags.Has("stream-tail")) {
+    data::OutputOptions output;
+    output.mode = flags.Has("stream-tail") ? data::OutputMode::kStreamTail
+                                           : data::OutputMode::kStream;
+    output.tail_limit = flags.GetNumber("stream-tail", output.tail_limit);
+    data::CommandLauncher::SetOutput(output);
+  }
+
+  // --stats=PATH writes resource usage of every command (csv or
+  // --stats-format=jsonl) and prints percentiles at exit
+  std::unique_ptr<data::StatsReporter> stats;
+  if (auto path = flags.Get("stats")) {
+    stats = std::make_unique<data::StatsReporter>(
+        *path, flags.Get("stats-format") == "jsonl" ? data::StatsFormat::kJsonl
+                                                    : data::StatsFormat::kCsv);
+    data::CommandLauncher::SetStats(stats.get());
+  }
+
+  // --cache=DIR reuses results of identical commands for --cache-ttl
+  // seconds, --cache-env makes the environment a part of the key
+  std::unique_ptr<data::ResultCache> cache;
+  if (auto dir = flags.Get("cache")) {
+    cache = std::make_unique<data::ResultCache>(data::CacheOptions{
+        .dir = *dir,
+        .ttl = std::chrono::seconds(flags.GetNumber("cache-ttl", 3600)),
+        .fingerprint_env = flags.Has("cache-env")});
+    data::CommandLauncher::SetResultCache(cache.get());
+  }
+
+  // --reactor[=N]: pool threads only spawn commands and N reactor threads
+  // collect the output, so the limit applies to spawning only
+  std::unique_ptr<data::Reactor> reactor;
+  if (flags.Has("reactor")) {
+    data::Reactor::WaitFunction wait;
+    if (zygote) {
+      wait = [&zygote](pid_t pid, rusage *usage) {
+        return zygote->Wait(pid, usage);
+      };
+    }
+    reactor = std::make_unique<data::Reactor>(flags.GetNumber("reactor", 1),
+                                              std::move(wait));
+    data::CommandLauncher::SetReactor(reactor.get());
+  }
+
+  // --timeout=MS kills commands (with their children) running longer
+  std::unique_ptr<data::Watchdog> watchdog;
+  if (flags.Has("timeout")) {
+    watchdog = std::make_unique<data::Watchdog>(
+        std::chrono::milliseconds(flags.GetNumber("timeout", 0)));
+    data::CommandLauncher::SetWatchdog(watchdog.get());
+  }
+
+  // Threads are started only when commands arrive, `threads` is still the
+  // limit of simultaneously running commands
   thread_pool::ThreadPool<data::CommandLauncher> tp{
-      threads, thread_pool::OverflowPolicy::kReject};
-
-  data::Command command{};
-  while (std::getline(std::cin, command.cmd)) {
-    if (!tp.AddTask(
-            data::CommandLauncher(std::make_unique<data::Command>(command)))) {
-      std::cout << "Cannot start more than " << threads << " tasks"
-                << std::endl;
+      thread_pool::ThreadPoolOptions{.max_threads = threads},
+      thread_pool::OverflowPolicy::kReject};
+
+  // Commands which do not fit wait in a queue of --queue=N for at most
+  // --max-wait=MS, --rate=R limits spawns per second with bursts of
+  // --burst=B. Only commands beyond that are rejected.
+  thread_pool::AdmissionOptions admission_options{
+      .queue_capacity = flags.GetNumber("queue", 0),
+      .max_wait = std::chrono::milliseconds(flags.GetNumber("max-wait", 0)),
+      .rate = static_cast<double>(flags.GetNumber("rate", 0)),
+      .burst = static_cast<double>(flags.GetNumber("burst", 1))};
+  bool report_admission = flags.Has("queue") || flags.Has("rate") ||
+                          flags.Has("timeout");
+
+  thread_pool::AdmissionController<data::CommandLauncher> admission{
+      tp, admission_options,
+      [threads, &admission_options](data::CommandLauncher &,
+                                    auto rejection) {
+        if (rejection == decltype(rejection)::kExpired) {
+          std::cout << "Cannot start task within "
+                    << admission_options.max_wait.count() << " ms"
+                    << std::endl;
+          return;
+        }
+        std::cout << "Cannot start more than " << threads << " tasks"
+                  << std::endl;
+      }};
+
+  // --metrics=PATH dumps pool metrics to the file, "-" means stderr
+  std::unique_ptr<thread_pool::MetricsReporter> metrics;
+  if (auto path = flags.Get("metrics")) {
+    metrics = std::make_unique<thread_pool::MetricsReporter>(
+        [&tp] { return tp.GetMetrics(); }, *path,
+        std::chrono::milliseconds(flags.GetNumber("metrics-interval", 1000)));
+  }
+
+  LineReader reader(STDIN_FILENO);
+  std::vector<std::string> lines;
+  std::vector<data::CommandLauncher> batch;
+
+  while (reader.ReadBatch(lines)) {
+    batch.clear();
+    for (auto &line : lines) {
+      batch.emplace_back(std::make_unique<data::Command>(std::move(line)));
     }
+
+    admission.Submit(batch.begin(), batch.end());
   }
 
+  // Let the metrics reporter dump the final state
+  admission.Drain();
+  tp.WaitForIdle();
+  if (reactor) {
+    reactor->WaitForAll();
+  }
+  if (stats) {
+    stats->PrintSummary(std::cerr);
+  }
+  if (report_admission) {
+    std::cerr << admission.GetStats()
+              << " killed=" << (watchdog ? watchdog->Killed() : 0) << std::endl;
+  }
   return 0;
 }
@@ -0,0 +1,179 @@
+#include <common/command.hpp>
+
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+namespace {
+
+std::string ReadFile(const std::string &path) {
+  std::string res;
+  std::FILE *file = std::fopen(path.c_str(), "r");
+  char buffer[4096];
+  size_t bytes;
+  while ((bytes = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    res.append(buffer, bytes);
+  }
+  std::fclose(file);
+  return res;
+}
+
+// Runs `cmd` streaming into one file, the finish records go to another
+std::pair<std::string, std::string> RunStreamed(const std::string &cmd,
+                                                data::OutputMode mode,
+                                                size_t tail_limit,
+                                                data::Reactor *reactor = nullptr) {
+  std::string stream_path = "/tmp/runsim_tests_stream";
+  std::string records_path = "/tmp/runsim_tests_records";
+  int stream_fd = ::open(stream_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  int records_fd = ::open(records_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  data::OutputOptions output;
+  output.mode = mode;
+  output.fd = stream_fd;
+  output.tail_limit = tail_limit;
+  data::CommandLauncher::SetOutput(output);
+  {
+    data::OutputWriter writer(records_fd, data::OutputOrder::kCompletion);
+    data::CommandLauncher::SetWriter(&writer);
+    data::CommandLauncher::SetReactor(reactor);
+    data::CommandLauncher(std::make_unique<data::Command>(cmd))();
+    if (reactor) {
+      reactor->WaitForAll();
+    }
+    data::CommandLauncher::SetReactor(nullptr);
+    data::CommandLauncher::SetWriter(nullptr);
+  }
+  ::close(stream_fd);
+  ::close(records_fd);
+
+  auto res = std::pair(ReadFile(stream_path), ReadFile(records_path));
+  ::unlink(stream_path.c_str());
+  ::unlink(records_path.c_str());
+  return res;
+}
+
+} // namespace
+
+int main() {
+  // Case 1: --stream-tail streams the whole output and repeats its last
+  // bytes in the finish record
+  {
+    auto [stream, records] =
+        RunStreamed("printf 0123456789abcdef", data::OutputMode::kStreamTail, 8);
+    assert(stream == "0123456789abcdef");
+    assert(records.find("output tail:\n89abcdef\n") != std::string::npos);
+    assert(records.find("01234567") == std::string::npos);
+  }
+
+  std::cout << "Case 1 completed" << std::endl;
+
+  // Case 2: the same through the reactor, output larger than a pipe buffer
+  {
+    data::Reactor reactor(1);
+    auto [stream, records] =
+        RunStreamed("seq 100000", data::OutputMode::kStreamTail, 13, &reactor);
+
+    assert(stream.size() == 588895);
+    assert(records.find("output tail:\n99999\n100000\n") != std::string::npos);
+  }
+
+  std::cout << "Case 2 completed" << std::endl;
+
+  // Case 3: plain --stream adds nothing to the record
+  {
+    auto [stream, records] =
+        RunStreamed("printf abc", data::OutputMode::kStream, 8);
+    assert(stream == "abc");
+    assert(records.find("abc") == std::string::npos);
+    assert(records.find("finished with status 0") != std::string::npos);
+  }
+
+  std::cout << "Case 3 completed" << std::endl;
+
+  // Case 4: coalesced waiters are released when the leader fails, commands
+  // are only coalesced with the same text
+  {
+    data::ResultCache cache({.dir = "/tmp/runsim_tests_cache"});
+    std::vector<int> statuses;
+    auto waiter = [&](const data::CachedResult &result) {
+      statuses.push_back(result.status);
+    };
+
+    assert(cache.Acquire(1, "false", waiter));
+    assert(!cache.Acquire(1, "false", waiter));
+    cache.Abandon(1, "false", {{}, -1});
+    assert((statuses == std::vector<int>{-1}));
+    assert(!cache.Lookup(1, "false"));
+
+    // Same key, other command: runs on its own and does not take the
+    // first one's waiters
+    assert(cache.Acquire(2, "echo a", waiter));
+    assert(!cache.Acquire(2, "echo a", waiter));
+    assert(cache.Acquire(2, "echo b", waiter));
+    cache.Complete(2, "echo b", {"b\n", 0});
+    assert(statuses.size() == 1);
+    cache.Complete(2, "echo a", {"a\n", 0});
+    assert((statuses == std::vector<int>{-1, 0}));
+    assert(cache.Lookup(2, "echo a")->output == "a\n");
+  }
+  std::system("rm -rf /tmp/runsim_tests_cache");
+
+  std::cout << "Case 4 completed" << std::endl;
+
+  // Case 5: a command which closed its stdout is still killed on timeout
+  {
+    data::Watchdog watchdog(std::chrono::milliseconds(100));
+    data::CommandLauncher::SetWatchdog(&watchdog);
+    auto [stream, records] =
+        RunStreamed("exec >&-; sleep 5", data::OutputMode::kCapture, 0);
+    data::CommandLauncher::SetWatchdog(nullptr);
+
+    assert(watchdog.Killed() == 1);
+    assert(records.find("finished with status 137") != std::string::npos);
+  }
+
+  std::cout << "Case 5 completed" << std::endl;
+
+  // Case 6: killed runs are not cached, normal exits are
+  {
+    data::ResultCache cache({.dir = "/tmp/runsim_tests_cache"});
+    data::Watchdog watchdog(std::chrono::milliseconds(100));
+    data::CommandLauncher::SetResultCache(&cache);
+    data::CommandLauncher::SetWatchdog(&watchdog);
+    RunStreamed("sleep 5", data::OutputMode::kCapture, 0);
+    RunStreamed("exit 3", data::OutputMode::kCapture, 0);
+    data::CommandLauncher::SetWatchdog(nullptr);
+    data::CommandLauncher::SetResultCache(nullptr);
+
+    assert(watchdog.Killed() == 1);
+    assert(!cache.Lookup(cache.Key("sleep 5"), "sleep 5"));
+    assert(cache.Lookup(cache.Key("exit 3"), "exit 3")->status == 3);
+  }
+  std::system("rm -rf /tmp/runsim_tests_cache");
+
+  std::cout << "Case 6 completed" << std::endl;
+
+  // Case 7: a command which cannot be spawned still gets its record, the
+  // ordered writer would wait for it forever otherwise
+  {
+    // Zygote does not take commands longer than its request buffer
+    data::Zygote zygote;
+    data::CommandLauncher::SetZygote(&zygote);
+    data::CommandLauncher::SetBackend(data::LaunchBackend::kZygote);
+    auto [stream, records] = RunStreamed("echo " + std::string(64 * 1024, 'x'),
+                                         data::OutputMode::kCapture, 0);
+    data::CommandLauncher::SetBackend(data::LaunchBackend::kSpawn);
+    data::CommandLauncher::SetZygote(nullptr);
+
+    assert(records.find("finished with status -1") != std::string::npos);
+  }
+
+  std::cout << "Case 7 completed" << std::endl;
+}
@@ -1,4 +1,5 @@
 #include <common/big_integer.hpp>
+#include <common/flags.hpp>
 #include <common/thread_pool.hpp>
 
 #include <iostream>
@@ -9,20 +10,32 @@ namespace {
 }
 
 int main(int argc, char** argv) {
+  cli::Flags flags(argc, argv);
   size_t threads = 0;
 
-  if (argc < 2) {
+  if (flags.Positional().empty()) {
     threads = std::thread::hardware_concurrency() + 1;
   } else {
     try {
-      threads = std::stoul(argv[1]);
+      threads = std::stoul(flags.Positional()[0]);
     } catch (const std::exception &ex) {
       std::cerr << "Cannot parse number of threads " << ex.what() << std::endl;
       threads = std::thread::hardware_concurrency() + 1;
     }
   }
 
-  ThreadPool tp{threads, thread_pool::OverflowPolicy::kAllow};
+  // --cpus=LIST pins workers, --numa keeps tasks on the submitter's node
+  thread_pool::Placement placement;
+  placement.cpus = topology::ParseCpuList(flags.Get("cpus").value_or(""));
+  placement.numa_aware = flags.Has("numa");
+
+  // --trace=PATH writes task spans and big multiplications as Chrome trace
+  // JSON at exit or on SIGINT/SIGTERM/SIGUSR1
+  if (auto path = flags.Get("trace")) {
+    trace::Tracer::Start(*path);
+  }
+
+  ThreadPool tp{threads, thread_pool::OverflowPolicy::kAllow, placement};
 
   int next;
   while (std::cin >> next) {
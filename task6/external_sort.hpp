@@ -0,0 +1,411 @@
+#pragma once
+
+#include "radix_sort.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace sort {
+
+enum class KeyType { kInt32, kUInt32, kInt64, kUInt64, kFloat, kDouble };
+
+// Binary file of fixed size records, each with a key at key_offset
+struct RecordFormat {
+  size_t record_size{0};
+  size_t key_offset{0};
+  KeyType key_type{KeyType::kUInt64};
+};
+
+// memory_bytes bounds the records held at once: a chunk being sorted, or
+// the read buffers of all runs while they are merged
+struct ExternalSortOptions {
+  size_t memory_bytes{size_t{256} << 20};
+  size_t io_block_bytes{size_t{4} << 20};
+  std::string temp_dir{"/tmp"};
+};
+
+namespace impl {
+
+inline size_t ReadFull(int fd, char *data, size_t size, off_t offset) {
+  size_t done = 0;
+  while (done < size) {
+    auto bytes = ::pread(fd, data + done, size - done, offset + done);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      throw std::runtime_error("Cannot read records");
+    }
+    if (bytes == 0) {
+      break;
+    }
+    done += bytes;
+  }
+  return done;
+}
+
+inline void WriteFull(int fd, const char *data, size_t size) {
+  while (size > 0) {
+    auto bytes = ::write(fd, data, size);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes < 0) {
+      throw std::runtime_error("Cannot write records");
+    }
+    data += bytes;
+    size -= bytes;
+  }
+}
+
+class File {
+public:
+  File(const std::string &path, int flags) {
+    fd_ = ::open(path.c_str(), flags | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+  }
+
+  // Anonymous temporary file, removed as soon as it is closed
+  static File Temporary(const std::string &dir) {
+    std::string path = dir + "/sort_run.XXXXXX";
+    int fd = ::mkostemp(path.data(), O_CLOEXEC);
+    if (fd < 0) {
+      throw std::runtime_error("Cannot create a run in " + dir);
+    }
+    ::unlink(path.c_str());
+    return File(fd);
+  }
+
+  File(File &&other) : fd_(std::exchange(other.fd_, -1)) {}
+  File &operator=(File &&) = delete;
+
+  ~File() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  int Fd() const { return fd_; }
+
+private:
+  explicit File(int fd) : fd_(fd) {}
+
+  int fd_{-1};
+};
+
+inline size_t KeySize(KeyType type) {
+  switch (type) {
+  case KeyType::kInt32:
+  case KeyType::kUInt32:
+  case KeyType::kFloat:
+    return 4;
+  default:
+    return 8;
+  }
+}
+
+// Order preserving key of a record, widened to 64 bits
+inline uint64_t RecordKey(const char *record, const RecordFormat &format) {
+  auto load = [&](auto value) {
+    std::memcpy(&value, record + format.key_offset, sizeof(value));
+    return static_cast<uint64_t>(OrderedBits(value));
+  };
+
+  switch (format.key_type) {
+  case KeyType::kInt32:
+    return load(int32_t{});
+  case KeyType::kUInt32:
+    return load(uint32_t{});
+  case KeyType::kInt64:
+    return load(int64_t{});
+  case KeyType::kUInt64:
+    return load(uint64_t{});
+  case KeyType::kFloat:
+    return load(float{});
+  case KeyType::kDouble:
+    return load(double{});
+  }
+  return 0;
+}
+
+// Reads [0, size) of a file block by block. The next block is read on
+// another thread while the current one is consumed.
+class BlockReader {
+public:
+  BlockReader(int fd, size_t size, size_t block)
+      : fd_(fd), size_(size), block_(block), current_(block), spare_(block) {
+    ReadAhead();
+  }
+
+  // The block stays valid until the next call, empty at the end
+  std::string_view Next() {
+    if (!pending_.valid()) {
+      return {};
+    }
+    size_t bytes = pending_.get();
+    std::swap(current_, spare_);
+    ReadAhead();
+    return {current_.data(), bytes};
+  }
+
+private:
+  void ReadAhead() {
+    if (offset_ >= size_) {
+      return;
+    }
+    size_t bytes = std::min(block_, size_ - offset_);
+    pending_ = std::async(std::launch::async, [this, bytes, offset = offset_] {
+      return ReadFull(fd_, spare_.data(), bytes, offset);
+    });
+    offset_ += bytes;
+  }
+
+  int fd_;
+  size_t size_;
+  size_t block_;
+  size_t offset_{0};
+  std::vector<char> current_;
+  std::vector<char> spare_;
+  std::future<size_t> pending_;
+};
+
+// Appends records to a file, full blocks are written on another thread
+// while the next one is filled
+class BlockWriter {
+public:
+  BlockWriter(int fd, size_t block) : fd_(fd), block_(block) {
+    current_.reserve(block_);
+    spare_.reserve(block_);
+  }
+
+  void Append(const char *data, size_t size) {
+    if (current_.size() + size > block_) {
+      Flush();
+    }
+    current_.insert(current_.end(), data, data + size);
+  }
+
+  // Waits until everything is written
+  void Finish() {
+    Flush();
+    if (pending_.valid()) {
+      pending_.get();
+    }
+  }
+
+private:
+  void Flush() {
+    if (pending_.valid()) {
+      pending_.get();
+    }
+    std::swap(current_, spare_);
+    current_.clear();
+    pending_ = std::async(std::launch::async,
+                          [this] { WriteFull(fd_, spare_.data(), spare_.size()); });
+  }
+
+  int fd_;
+  size_t block_;
+  std::vector<char> current_;
+  std::vector<char> spare_;
+  std::future<void> pending_;
+};
+
+// Tournament tree over k sources keeping the loser of every match, so
+// replacing the winner costs one path of log k comparisons against the
+// stored losers. Equal keys are won by the lower source, which keeps the
+// merge of runs formed in input order stable.
+class LoserTree {
+public:
+  explicit LoserTree(size_t sources)
+      : keys_(sources), done_(sources, false), tree_(std::max<size_t>(sources, 1)) {}
+
+  void Set(size_t source, uint64_t key) { keys_[source] = key; }
+  void SetDone(size_t source) { done_[source] = true; }
+
+  // Has to be called once all sources are set
+  void Build() {
+    size_t k = keys_.size();
+    std::vector<size_t> winners(2 * k);
+    for (size_t i = 0; i < k; ++i) {
+      winners[k + i] = i;
+    }
+    for (size_t node = k - 1; node >= 1; --node) {
+      size_t lhs = winners[2 * node];
+      size_t rhs = winners[2 * node + 1];
+      winners[node] = Less(lhs, rhs) ? lhs : rhs;
+      tree_[node] = Less(lhs, rhs) ? rhs : lhs;
+    }
+    tree_[0] = k > 1 ? winners[1] : 0;
+  }
+
+  // Source with the smallest key, nullopt when all are done
+  std::optional<size_t> Winner() const {
+    return done_[tree_[0]] ? std::nullopt : std::optional(tree_[0]);
+  }
+
+  // Has to be called after the winner's key was replaced or it is done
+  void Replay() {
+    size_t winner = tree_[0];
+    for (size_t node = (winner + keys_.size()) / 2; node >= 1; node /= 2) {
+      if (Less(tree_[node], winner)) {
+        std::swap(tree_[node], winner);
+      }
+    }
+    tree_[0] = winner;
+  }
+
+private:
+  bool Less(size_t lhs, size_t rhs) const {
+    if (done_[lhs] || done_[rhs]) {
+      return !done_[lhs] && (done_[rhs] || lhs < rhs);
+    }
+    return keys_[lhs] != keys_[rhs] ? keys_[lhs] < keys_[rhs] : lhs < rhs;
+  }
+
+  std::vector<uint64_t> keys_;
+  std::vector<bool> done_;
+  std::vector<size_t> tree_;
+};
+
+struct Run {
+  File file;
+  size_t size;
+};
+
+// Sorts `count` records of `chunk` into `sorted` with radix sort of
+// (key, index) pairs and a parallel gather
+inline void SortChunk(const char *chunk, size_t count, char *sorted,
+                      const RecordFormat &format, ThreadPool &pool) {
+  struct Entry {
+    uint64_t key;
+    uint64_t index;
+  };
+
+  std::vector<Entry> entries(count);
+  for (size_t i = 0; i < count; ++i) {
+    entries[i] = Entry{RecordKey(chunk + i * format.record_size, format), i};
+  }
+  RadixSort(entries.begin(), entries.end(),
+            [](const Entry &entry) { return entry.key; }, pool);
+
+  Tasks tasks;
+  size_t parts = pool.Size() + 1;
+  for (size_t part = 0; part < parts; ++part) {
+    tasks.emplace_back([&, part] {
+      size_t size = format.record_size;
+      for (size_t i = count * part / parts; i < count * (part + 1) / parts; ++i) {
+        std::memcpy(sorted + i * size, chunk + entries[i].index * size, size);
+      }
+    });
+  }
+  RunTasks(&pool, tasks);
+}
+
+} // namespace impl
+
+// Sorts a file of fixed size records which does not have to fit into
+// memory. Chunks of memory_bytes / 2 are sorted on the pool and spilled as
+// runs into temp_dir, then all runs are merged at once through a loser
+// tree with read-ahead and write-behind of io_block_bytes blocks. Records
+// with equal keys keep their input order.
+inline void ExternalSort(const std::string &input, const std::string &output,
+                         const RecordFormat &format,
+                         const ExternalSortOptions &options,
+                         impl::ThreadPool &pool) {
+  size_t record = format.record_size;
+  if (format.key_offset + impl::KeySize(format.key_type) > record) {
+    throw std::runtime_error("Key does not fit into a record");
+  }
+
+  impl::File in(input, O_RDONLY);
+  struct stat info;
+  if (::fstat(in.Fd(), &info) != 0 || info.st_size % record != 0) {
+    throw std::runtime_error("Input is not a whole number of records");
+  }
+  size_t total = info.st_size;
+
+  // The chunk and its sorted copy share the memory, the index of 16 bytes
+  // per record is not counted
+  size_t chunk_records = std::max<size_t>(options.memory_bytes / 2 / record, 1);
+  std::vector<char> chunk(std::min(total, chunk_records * record));
+  std::vector<char> sorted(chunk.size());
+
+  impl::File out(output, O_WRONLY | O_CREAT | O_TRUNC);
+  std::vector<impl::Run> runs;
+  for (size_t offset = 0; offset < total; offset += chunk.size()) {
+    size_t bytes = impl::ReadFull(in.Fd(), chunk.data(),
+                                  std::min(chunk.size(), total - offset), offset);
+    impl::SortChunk(chunk.data(), bytes / record, sorted.data(), format, pool);
+
+    // Everything fits into one chunk: no runs at all
+    if (bytes == total) {
+      impl::WriteFull(out.Fd(), sorted.data(), bytes);
+      return;
+    }
+
+    runs.push_back(impl::Run{impl::File::Temporary(options.temp_dir), bytes});
+    impl::WriteFull(runs.back().file.Fd(), sorted.data(), bytes);
+  }
+  chunk = {};
+  sorted = {};
+  if (runs.empty()) {
+    return;
+  }
+
+  // Two blocks per run and two for the output
+  size_t block = options.memory_bytes / (2 * (runs.size() + 1));
+  block = std::max(std::min(block, options.io_block_bytes) / record, size_t{1}) * record;
+
+  std::vector<std::unique_ptr<impl::BlockReader>> readers;
+  std::vector<std::string_view> blocks(runs.size());
+  impl::LoserTree tree(runs.size());
+
+  auto advance = [&](size_t run) {
+    if (blocks[run].size() <= record) {
+      blocks[run] = readers[run]->Next();
+    } else {
+      blocks[run].remove_prefix(record);
+    }
+    if (blocks[run].empty()) {
+      tree.SetDone(run);
+    } else {
+      tree.Set(run, impl::RecordKey(blocks[run].data(), format));
+    }
+  };
+
+  for (size_t run = 0; run < runs.size(); ++run) {
+    readers.push_back(std::make_unique<impl::BlockReader>(
+        runs[run].file.Fd(), runs[run].size, block));
+    advance(run);
+  }
+  tree.Build();
+
+  impl::BlockWriter writer(out.Fd(), block);
+  while (auto run = tree.Winner()) {
+    writer.Append(blocks[*run].data(), record);
+    advance(*run);
+    tree.Replay();
+  }
+  writer.Finish();
+}
+
+} // namespace sort
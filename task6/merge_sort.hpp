@@ -1,8 +1,14 @@
-//#pragma once
+#pragma once
+
+#include "simd_sort.hpp"
 
 #include <common/thread_pool.hpp>
 
+#include <algorithm>
 #include <functional>
+#include <iterator>
+#include <type_traits>
+#include <vector>
 
 
 namespace sort {
@@ -13,77 +19,271 @@ using ThreadPool =
     thread_pool::ThreadPool<std::function<void()>>;
 using ThreadPoolTask = typename ThreadPool::TaskPtr;
 
-// This class is needed only to save context (tp_, compare_)
-template <class RandomIt, class RandomIt2, class Compare>
+// Runs shorter than this are not split further: std::sort is faster than
+// merging them, and a task per run would cost more than the run itself
+static constexpr size_t kSequentialCutoff = 1 << 13;
+// More leaves than threads, so uneven leaves still keep every thread busy
+static constexpr size_t kLeavesPerThread = 4;
+
+// Moves the merge of sorted [first1, last1) and [first2, last2) to `out`.
+// Equal elements are taken from the left run first.
+template <class InIt, class OutIt, class Compare>
+OutIt MergeMove(InIt first1, InIt last1, InIt first2, InIt last2, OutIt out,
+                Compare compare) {
+  // Equal elements of the kernel types are indistinguishable
+  if constexpr (kSimdMerge<InIt, OutIt, Compare>) {
+    if (SimdAvailable()) {
+      auto end = SimdMerge<Compare>(
+          std::to_address(first1), std::to_address(last1),
+          std::to_address(first2), std::to_address(last2), std::to_address(out));
+      return out + (end - std::to_address(out));
+    }
+  }
+
+  while (first1 != last1 && first2 != last2) {
+    if (compare(*first2, *first1)) {
+      *out++ = std::move(*first2++);
+    } else {
+      *out++ = std::move(*first1++);
+    }
+  }
+  out = std::move(first1, last1, out);
+  return std::move(first2, last2, out);
+}
+
+// Number of elements of [a, a + n) among the first k elements of the
+// stable merge of [a, a + n) and [b, b + m): the merge path crosses the
+// k-th diagonal there, so the output splits into independent merges.
+template <class It1, class It2, class Compare>
+size_t CoRank(size_t k, It1 a, size_t n, It2 b, size_t m, Compare compare) {
+  size_t lo = k > m ? k - m : 0;
+  size_t hi = std::min(k, n);
+  while (lo < hi) {
+    size_t i = lo + (hi - lo) / 2;
+    size_t j = k - i;
+    if (j > 0 && !compare(b[j - 1], a[i])) {
+      lo = i + 1;
+    } else {
+      hi = i;
+    }
+  }
+  return lo;
+}
+
+using Tasks = std::vector<std::function<void()>>;
+
+// Spreads the tasks over the pool and the calling thread
+inline void RunTasks(ThreadPool *tp, Tasks &tasks) {
+  if (tasks.empty()) {
+    return;
+  }
+
+  thread_pool::TaskGroupPtr group;
+  if (tp && tasks.size() > 1) {
+    group = tp->AddTasks(tasks.begin(), tasks.end() - 1);
+  } else {
+    for (size_t i = 0; i + 1 < tasks.size(); ++i) {
+      tasks[i]();
+    }
+  }
+
+  tasks.back()();
+  if (group) {
+    group->Wait();
+  }
+}
+
+// Adds `parts` tasks, each producing an equal slice of the output of
+// merge(first1, last1, first2, last2, out, compare). Every task finds its
+// slice of the inputs with CoRank.
+template <class It1, class It2, class OutIt, class Compare, class Merge>
+void AddMergeParts(Tasks &tasks, It1 first1, It1 last1, It2 first2, It2 last2,
+                   OutIt out, size_t parts, Compare compare, Merge merge) {
+  size_t n = std::distance(first1, last1);
+  size_t m = std::distance(first2, last2);
+  for (size_t part = 0; part < parts; ++part) {
+    size_t begin = (n + m) * part / parts;
+    size_t end = (n + m) * (part + 1) / parts;
+    tasks.emplace_back([=] {
+      size_t i0 = CoRank(begin, first1, n, first2, m, compare);
+      size_t i1 = CoRank(end, first1, n, first2, m, compare);
+      merge(first1 + i0, first1 + i1, first2 + (begin - i0),
+            first2 + (end - i1), out + begin, compare);
+    });
+  }
+}
+
+// Scratch space of the same size as the range. Elements are only moved
+// into it, so it is default constructed when the type allows.
+template <class RandomIt>
+auto MakeBuffer(RandomIt first, RandomIt last) {
+  using Value = typename std::iterator_traits<RandomIt>::value_type;
+  if constexpr (std::is_default_constructible_v<Value>) {
+    return std::vector<Value>(std::distance(first, last));
+  } else {
+    return std::vector<Value>(first, last);
+  }
+}
+
+// Bottom-up merge sort. The range is cut into a power of two leaves which
+// are sorted with std::sort, or the AVX2 kernels when the type allows, then
+// every level merges pairs of runs in
+// parallel, moving them between the range and the buffer in turn, so no
+// level copies anything back. With an odd number of levels the leaves are
+// sorted in the buffer, so the last level writes into the range.
+template <class RandomIt, class Compare>
 class MergeSortWrapper {
 public:
-  MergeSortWrapper(size_t threads, Compare compare)
-      : tp_(threads, thread_pool::OverflowPolicy::kAllow), compare_(compare) {}
+  // Without a pool everything runs on the calling thread
+  MergeSortWrapper(ThreadPool *tp, size_t threads, Compare compare)
+      : tp_(tp), threads_(tp ? std::max<size_t>(threads, 1) : 1),
+        compare_(compare) {}
 
-  typename ThreadPool::TaskPtr MergeSort(RandomIt, RandomIt, RandomIt2,
-                                         RandomIt2);
+  void Sort(RandomIt first, RandomIt last);
 
 private:
-  ThreadPool tp_;
+  template <class InIt, class OutIt>
+  void MergeLevel(InIt in, OutIt out, size_t width);
+
+  // Sorts a leaf, `scratch` of the same size may be clobbered
+  template <class It, class ScratchIt>
+  void SortLeaf(It first, It last, ScratchIt scratch) {
+    TRACE_SCOPE_VALUE("sort_leaf", std::distance(first, last));
+    if constexpr (kSimdSort<It, Compare> && kSimdSort<ScratchIt, Compare>) {
+      if (SimdAvailable()) {
+        SimdSort<Compare>(std::to_address(first), std::distance(first, last),
+                          std::to_address(scratch));
+        return;
+      }
+    }
+    std::sort(first, last, compare_);
+  }
+
+  void Run(Tasks &tasks) { RunTasks(tp_, tasks); }
+
+  size_t Bound(size_t leaf) const { return size_ * leaf / leaves_; }
+
+  ThreadPool *tp_;
+  size_t threads_;
   Compare compare_;
+
+  size_t size_{0};
+  size_t leaves_{1};
 };
 
-template <class RandomIt, class RandomIt2, class Compare>
-ThreadPoolTask MergeSortWrapper<RandomIt, RandomIt2, Compare>::MergeSort(
-    RandomIt first, RandomIt last, RandomIt2 extra_first,
-    RandomIt2 extra_last) {
+template <class RandomIt, class Compare>
+void MergeSortWrapper<RandomIt, Compare>::Sort(RandomIt first, RandomIt last) {
+  size_ = std::distance(first, last);
+  leaves_ = 1;
+  size_t depth = 0;
+  while (threads_ > 1 && leaves_ < threads_ * kLeavesPerThread &&
+         size_ / (leaves_ * 2) >= kSequentialCutoff) {
+    leaves_ *= 2;
+    ++depth;
+  }
 
-  size_t delta = std::distance(first, last);
-  if (delta < 2) {
-    return nullptr;
+  if (depth == 0) {
+    if constexpr (kSimdSort<RandomIt, Compare>) {
+      if (SimdAvailable()) {
+        auto buffer = MakeBuffer(first, last);
+        SortLeaf(first, last, buffer.begin());
+        return;
+      }
+    }
+    std::sort(first, last, compare_);
+    return;
   }
 
-  RandomIt mid = first + delta / 2;
-  RandomIt2 extra_mid = extra_first + delta / 2;
+  auto buffer = MakeBuffer(first, last);
+  auto extra = buffer.begin();
 
-  auto task1_ptr = MergeSort(first, mid, extra_first, extra_mid);
-  auto task2_ptr = MergeSort(mid, last, extra_mid, extra_last);
+  Tasks tasks;
+  for (size_t i = 0; i < leaves_; ++i) {
+    size_t lo = Bound(i);
+    size_t hi = Bound(i + 1);
+    if (depth % 2 == 1) {
+      tasks.emplace_back([=, this] {
+        std::move(first + lo, first + hi, extra + lo);
+        SortLeaf(extra + lo, extra + hi, first + lo);
+      });
+    } else {
+      tasks.emplace_back(
+          [=, this] { SortLeaf(first + lo, first + hi, extra + lo); });
+    }
+  }
+  Run(tasks);
 
-  if (task1_ptr) { task1_ptr->Wait(); }
-  if (task2_ptr) { task2_ptr->Wait(); }
+  for (size_t level = 1; level <= depth; ++level) {
+    if ((depth - level) % 2 == 0) {
+      MergeLevel(extra, first, size_t{1} << level);
+    } else {
+      MergeLevel(first, extra, size_t{1} << level);
+    }
+  }
+}
 
-  // We need to place completable tasks first, because tasks in ThreadPool 
-  // can not reschedule, because I'm too lazy to make context swithching
-  return tp_.AddTask([=, this]() {
-    // or it can be...
-    //std::inplace_merge(first, mid, last, compare_);
+// Merges neighbouring runs of width / 2 leaves from `in` to `out`. Upper
+// levels have fewer merges than threads, so every merge is split into
+// parts by merge path to keep all threads busy.
+template <class RandomIt, class Compare>
+template <class InIt, class OutIt>
+void MergeSortWrapper<RandomIt, Compare>::MergeLevel(InIt in, OutIt out,
+                                                     size_t width) {
+  TRACE_SCOPE_VALUE("merge_level", width);
+  size_t merges = leaves_ / width;
+  size_t parts = std::max<size_t>(1, threads_ / merges);
+  auto merge = [](auto... args) { MergeMove(args...); };
 
-    std::copy(first, last, extra_first);
+  Tasks tasks;
+  for (size_t leaf = 0; leaf < leaves_; leaf += width) {
+    size_t lo = Bound(leaf);
+    size_t mid = Bound(leaf + width / 2);
+    size_t hi = Bound(leaf + width);
+    AddMergeParts(tasks, in + lo, in + mid, in + mid, in + hi, out + lo, parts,
+                  compare_, merge);
+  }
+  Run(tasks);
+}
 
-    RandomIt cur = first;
-    RandomIt2 left = extra_first;
-    RandomIt2 right = extra_mid;
+} // namespace impl
 
-    while (left != extra_mid || right != extra_last) {
-      if (left == extra_mid) {
-        *cur = *right++;
-      } else if (right == extra_last) {
-        *cur = *left++;
-      } else {
-        *cur = compare_(*left, *right) ? *left++ : *right++;
-      }
+// Same as std::merge, but the output is produced by up to pool.Size() + 1
+// threads at once, split into independent parts by merge path
+template <class It1, class It2, class OutIt, class Compare>
+OutIt ParallelMerge(It1 first1, It1 last1, It2 first2, It2 last2, OutIt out,
+                    Compare compare, impl::ThreadPool &pool) {
+  size_t size = std::distance(first1, last1) + std::distance(first2, last2);
+  size_t parts = std::clamp<size_t>(size / impl::kSequentialCutoff, 1,
+                                    pool.Size() + 1);
 
-      cur++;
-    }
-  });
+  impl::Tasks tasks;
+  impl::AddMergeParts(tasks, first1, last1, first2, last2, out, parts, compare,
+                      [](auto... args) { std::merge(args...); });
+  impl::RunTasks(&pool, tasks);
+  return out + size;
 }
 
-} // namespace impl
+// Sorts on a long-lived pool, the calling thread takes part too
+template <class RandomIt, class Compare>
+void MergeSort(RandomIt first, RandomIt last, Compare comparer,
+               impl::ThreadPool &pool) {
+  impl::MergeSortWrapper<RandomIt, Compare> wrap(&pool, pool.Size() + 1,
+                                                  comparer);
+  wrap.Sort(first, last);
+}
 
 template <class RandomIt, class Compare>
 void MergeSort(RandomIt first, RandomIt last, Compare comparer,
                size_t threads) {
-  std::vector extra_data(first, last);
+  if (threads <= 1) {
+    impl::MergeSortWrapper<RandomIt, Compare> wrap(nullptr, 1, comparer);
+    wrap.Sort(first, last);
+    return;
+  }
+
   // one thread less because main thread already used
-  impl::MergeSortWrapper<RandomIt, decltype(extra_data.begin()), Compare> wrap(
-      threads - 1, comparer);
-  auto task = wrap.MergeSort(first, last, extra_data.begin(), extra_data.end());
+  impl::ThreadPool pool(threads - 1, thread_pool::OverflowPolicy::kAllow);
+  MergeSort(first, last, comparer, pool);
 }
 
 } // namespace sort
-
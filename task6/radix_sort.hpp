@@ -0,0 +1,255 @@
+#pragma once
+
+#include "merge_sort.hpp"
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <type_traits>
+#include <vector>
+
+
+namespace sort {
+
+// Default key extractor of RadixSort: the element itself
+struct Identity {
+  template <class T>
+  const T &operator()(const T &value) const {
+    return value;
+  }
+};
+
+namespace impl {
+
+template <class T>
+constexpr bool kRadixKey = std::is_arithmetic_v<T> && !std::is_same_v<T, bool> &&
+                           sizeof(T) <= sizeof(uint64_t);
+
+template <size_t Size>
+using UnsignedOfSize = std::conditional_t<
+    Size == 1, uint8_t,
+    std::conditional_t<Size == 2, uint16_t,
+                       std::conditional_t<Size == 4, uint32_t, uint64_t>>>;
+
+// Maps an arithmetic key to an unsigned integer of the same order: the
+// sign bit of signed integers is flipped, negative floats are inverted
+// and positive ones get the sign bit set
+template <class T>
+auto OrderedBits(T value) {
+  static_assert(kRadixKey<T>, "radix keys are arithmetic types");
+  using Bits = UnsignedOfSize<sizeof(T)>;
+  constexpr Bits kSign = Bits{1} << (sizeof(T) * 8 - 1);
+
+  if constexpr (std::is_floating_point_v<T>) {
+    auto bits = std::bit_cast<Bits>(value);
+    return static_cast<Bits>(bits & kSign ? ~bits : bits | kSign);
+  } else if constexpr (std::is_signed_v<T>) {
+    return static_cast<Bits>(static_cast<Bits>(value) ^ kSign);
+  } else {
+    return static_cast<Bits>(value);
+  }
+}
+
+static constexpr size_t kRadixBits = 8;
+static constexpr size_t kBuckets = size_t{1} << kRadixBits;
+// Below this a comparison sort wins over passes of 256 buckets
+static constexpr size_t kRadixCutoff = 1 << 11;
+
+// Stable LSD radix sort by `bits(element)`, an unsigned integer. Every pass
+// is split into contiguous blocks, one per thread: each block counts its
+// digits, the counts give every block its own output cursors, then the
+// blocks are scattered independently. Passes move elements between the
+// range and a buffer; a pass where all elements share one digit is skipped.
+template <class RandomIt, class Bits>
+class RadixSorter {
+public:
+  RadixSorter(ThreadPool *tp, size_t threads, Bits bits)
+      : tp_(tp), threads_(tp ? std::max<size_t>(threads, 1) : 1), bits_(bits) {}
+
+  void Sort(RandomIt first, RandomIt last);
+
+private:
+  using Value = typename std::iterator_traits<RandomIt>::value_type;
+  using Counts = std::array<size_t, kBuckets>;
+
+  // Small trivially copyable elements are gathered per digit in cache line
+  // sized chunks before being written, so the scatter writes whole lines
+  // instead of touching 256 lines at random
+  static constexpr size_t kCombined = 64 / std::max<size_t>(sizeof(Value), 1);
+
+  template <class OutIt>
+  static constexpr bool kWriteCombining =
+      std::is_trivially_copyable_v<Value> && sizeof(Value) <= 16 &&
+      std::contiguous_iterator<OutIt>;
+
+  size_t Digit(const Value &value, size_t shift) const {
+    return (bits_(value) >> shift) & (kBuckets - 1);
+  }
+
+  // Returns false if the pass was skipped
+  template <class InIt, class OutIt>
+  bool Pass(InIt in, OutIt out, size_t shift);
+
+  template <class InIt, class OutIt>
+  void Scatter(InIt in, size_t lo, size_t hi, OutIt out, Counts &cursors,
+               size_t shift) const;
+
+  void Run(Tasks &tasks) { RunTasks(tp_, tasks); }
+
+  size_t Bound(size_t part) const { return size_ * part / parts_; }
+
+  ThreadPool *tp_;
+  size_t threads_;
+  Bits bits_;
+
+  size_t size_{0};
+  size_t parts_{1};
+};
+
+template <class RandomIt, class Bits>
+void RadixSorter<RandomIt, Bits>::Sort(RandomIt first, RandomIt last) {
+  size_ = std::distance(first, last);
+  if (size_ < kRadixCutoff) {
+    std::stable_sort(first, last, [this](const Value &lhs, const Value &rhs) {
+      return bits_(lhs) < bits_(rhs);
+    });
+    return;
+  }
+
+  parts_ = std::clamp<size_t>(size_ / kRadixCutoff, 1, threads_);
+  auto buffer = MakeBuffer(first, last);
+  auto extra = buffer.begin();
+
+  using Key = decltype(bits_(*first));
+  bool in_buffer = false;
+  for (size_t shift = 0; shift < sizeof(Key) * 8; shift += kRadixBits) {
+    bool moved = in_buffer ? Pass(extra, first, shift) : Pass(first, extra, shift);
+    in_buffer ^= moved;
+  }
+
+  if (in_buffer) {
+    Tasks tasks;
+    for (size_t part = 0; part < parts_; ++part) {
+      tasks.emplace_back([=, this] {
+        std::move(extra + Bound(part), extra + Bound(part + 1),
+                  first + Bound(part));
+      });
+    }
+    Run(tasks);
+  }
+}
+
+template <class RandomIt, class Bits>
+template <class InIt, class OutIt>
+bool RadixSorter<RandomIt, Bits>::Pass(InIt in, OutIt out, size_t shift) {
+  std::vector<Counts> counts(parts_);
+
+  Tasks tasks;
+  for (size_t part = 0; part < parts_; ++part) {
+    tasks.emplace_back([=, this, &counts] {
+      Counts &local = counts[part];
+      local.fill(0);
+      for (size_t i = Bound(part); i < Bound(part + 1); ++i) {
+        ++local[Digit(in[i], shift)];
+      }
+    });
+  }
+  Run(tasks);
+
+  // Block p of digit d goes after all smaller digits and after digit d of
+  // the blocks before p, which keeps the sort stable
+  size_t offset = 0;
+  for (size_t digit = 0; digit < kBuckets; ++digit) {
+    size_t total = 0;
+    for (auto &local : counts) {
+      size_t count = local[digit];
+      local[digit] = offset + total;
+      total += count;
+    }
+    if (total == size_) {
+      return false;
+    }
+    offset += total;
+  }
+
+  tasks.clear();
+  for (size_t part = 0; part < parts_; ++part) {
+    tasks.emplace_back([=, this, &counts] {
+      Scatter(in, Bound(part), Bound(part + 1), out, counts[part], shift);
+    });
+  }
+  Run(tasks);
+  return true;
+}
+
+template <class RandomIt, class Bits>
+template <class InIt, class OutIt>
+void RadixSorter<RandomIt, Bits>::Scatter(InIt in, size_t lo, size_t hi,
+                                          OutIt out, Counts &cursors,
+                                          size_t shift) const {
+  if constexpr (kWriteCombining<OutIt>) {
+    alignas(64) unsigned char lines[kBuckets][kCombined * sizeof(Value)];
+    std::array<uint8_t, kBuckets> filled{};
+    Value *dst = std::to_address(out);
+
+    for (size_t i = lo; i < hi; ++i) {
+      size_t digit = Digit(in[i], shift);
+      std::memcpy(lines[digit] + filled[digit] * sizeof(Value), &in[i],
+                  sizeof(Value));
+      if (++filled[digit] == kCombined) {
+        std::memcpy(dst + cursors[digit], lines[digit], sizeof(lines[digit]));
+        cursors[digit] += kCombined;
+        filled[digit] = 0;
+      }
+    }
+
+    for (size_t digit = 0; digit < kBuckets; ++digit) {
+      std::memcpy(dst + cursors[digit], lines[digit], filled[digit] * sizeof(Value));
+      cursors[digit] += filled[digit];
+    }
+  } else {
+    for (size_t i = lo; i < hi; ++i) {
+      out[cursors[Digit(in[i], shift)]++] = std::move(in[i]);
+    }
+  }
+}
+
+template <class RandomIt, class Bits>
+void RadixSortBits(RandomIt first, RandomIt last, Bits bits, ThreadPool *tp,
+                   size_t threads) {
+  RadixSorter<RandomIt, Bits> sorter(tp, threads, bits);
+  sorter.Sort(first, last);
+}
+
+} // namespace impl
+
+// Stable ascending sort by key(element), which has to be arithmetic, e.g.
+// the first member of key-value pairs. Runs on a long-lived pool, the
+// calling thread takes part too.
+template <class RandomIt, class KeyFn>
+void RadixSort(RandomIt first, RandomIt last, KeyFn key,
+               impl::ThreadPool &pool) {
+  impl::RadixSortBits(
+      first, last,
+      [key](const auto &value) { return impl::OrderedBits(key(value)); },
+      &pool, pool.Size() + 1);
+}
+
+template <class RandomIt, class KeyFn>
+void RadixSort(RandomIt first, RandomIt last, KeyFn key, size_t threads) {
+  auto bits = [key](const auto &value) {
+    return impl::OrderedBits(key(value));
+  };
+  if (threads <= 1) {
+    impl::RadixSortBits(first, last, bits, nullptr, 1);
+    return;
+  }
+
+  // one thread less because main thread already used
+  impl::ThreadPool pool(threads - 1, thread_pool::OverflowPolicy::kAllow);
+  impl::RadixSortBits(first, last, bits, &pool, threads);
+}
+
+} // namespace sort
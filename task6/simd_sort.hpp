@@ -0,0 +1,298 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+
+namespace sort {
+
+namespace impl {
+
+template <class Compare, class Value>
+constexpr bool kIsLess = std::is_same_v<Compare, std::less<Value>> ||
+                         std::is_same_v<Compare, std::less<>>;
+
+template <class Compare, class Value>
+constexpr bool kIsGreater = std::is_same_v<Compare, std::greater<Value>> ||
+                            std::is_same_v<Compare, std::greater<>>;
+
+template <class T>
+constexpr bool kSimdType = std::is_same_v<T, int32_t> ||
+                           std::is_same_v<T, int64_t> || std::is_same_v<T, float>;
+
+template <class It>
+using IterValue = typename std::iterator_traits<It>::value_type;
+
+// Ranges the vector kernels can sort: contiguous elements of a kernel type
+// ordered by std::less or std::greater
+template <class It, class Compare>
+constexpr bool kSimdSort = std::contiguous_iterator<It> &&
+                           kSimdType<IterValue<It>> &&
+                           (kIsLess<Compare, IterValue<It>> ||
+                            kIsGreater<Compare, IterValue<It>>);
+
+template <class InIt, class OutIt, class Compare>
+constexpr bool kSimdMerge = kSimdSort<InIt, Compare> && kSimdSort<OutIt, Compare> &&
+                            std::is_same_v<IterValue<InIt>, IterValue<OutIt>>;
+
+#if defined(__x86_64__)
+
+#define SORT_AVX2 __attribute__((target("avx2")))
+
+inline bool SimdAvailable() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+using Reg = __m256i;
+
+// Lane-wise minimum and maximum of one element type
+template <class T>
+struct Lanes;
+
+template <>
+struct Lanes<int32_t> {
+  static constexpr int kCount = 8;
+  SORT_AVX2 static Reg Min(Reg a, Reg b) { return _mm256_min_epi32(a, b); }
+  SORT_AVX2 static Reg Max(Reg a, Reg b) { return _mm256_max_epi32(a, b); }
+};
+
+// min_ps/max_ps return the second operand for -0.0/+0.0 and NaN, so both
+// outputs of an exchange could get the same element. Floats are compared as
+// integer keys instead, in a total order: -NaN < -0.0 < +0.0 < +NaN.
+template <>
+struct Lanes<float> {
+  static constexpr int kCount = 8;
+
+  // Flips magnitude bits of negative floats, the map is its own inverse
+  SORT_AVX2 static Reg Key(Reg a) {
+    return _mm256_xor_si256(a, _mm256_srli_epi32(_mm256_srai_epi32(a, 31), 1));
+  }
+
+  SORT_AVX2 static Reg Min(Reg a, Reg b) {
+    return Key(_mm256_min_epi32(Key(a), Key(b)));
+  }
+  SORT_AVX2 static Reg Max(Reg a, Reg b) {
+    return Key(_mm256_max_epi32(Key(a), Key(b)));
+  }
+};
+
+// AVX2 has no 64-bit min/max, they are built from a compare and a blend
+template <>
+struct Lanes<int64_t> {
+  static constexpr int kCount = 4;
+  SORT_AVX2 static Reg Min(Reg a, Reg b) {
+    return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b));
+  }
+  SORT_AVX2 static Reg Max(Reg a, Reg b) {
+    return _mm256_blendv_epi8(b, a, _mm256_cmpgt_epi64(a, b));
+  }
+};
+
+// Bitonic networks inside one register and a merge of sorted arrays built
+// on them. Lanes are permuted with 32-bit granularity, so 64-bit elements
+// move as pairs of 32-bit lanes.
+template <class T, bool kDescending>
+struct Avx2Kernels {
+  static constexpr int kLanes = Lanes<T>::kCount;
+  static constexpr int kWidth = 8 / kLanes;
+
+  static bool Before(T lhs, T rhs) { return kDescending ? rhs < lhs : lhs < rhs; }
+
+  SORT_AVX2 static Reg Load(const T *data) {
+    return _mm256_loadu_si256(reinterpret_cast<const Reg *>(data));
+  }
+
+  SORT_AVX2 static void Store(T *data, Reg reg) {
+    _mm256_storeu_si256(reinterpret_cast<Reg *>(data), reg);
+  }
+
+  SORT_AVX2 static Reg Load32(const int32_t *data) {
+    return _mm256_loadu_si256(reinterpret_cast<const Reg *>(data));
+  }
+
+  SORT_AVX2 static Reg Lo(Reg a, Reg b) {
+    return kDescending ? Lanes<T>::Max(a, b) : Lanes<T>::Min(a, b);
+  }
+
+  SORT_AVX2 static Reg Hi(Reg a, Reg b) {
+    return kDescending ? Lanes<T>::Min(a, b) : Lanes<T>::Max(a, b);
+  }
+
+  // Element i takes element i ^ X
+  template <int X>
+  SORT_AVX2 static Reg Permute(Reg reg) {
+    static constexpr auto kIndex = [] {
+      std::array<int32_t, 8> index{};
+      for (int lane = 0; lane < 8; ++lane) {
+        index[lane] = (lane / kWidth ^ X) * kWidth + lane % kWidth;
+      }
+      return index;
+    }();
+    return _mm256_permutevar8x32_epi32(reg, Load32(kIndex.data()));
+  }
+
+  // Compares element i with element i ^ X, elements with Bit set in their
+  // index keep the later one in the order
+  template <int X, int Bit>
+  SORT_AVX2 static Reg Exchange(Reg reg) {
+    static constexpr auto kMask = [] {
+      std::array<int32_t, 8> mask{};
+      for (int lane = 0; lane < 8; ++lane) {
+        mask[lane] = lane / kWidth & Bit ? -1 : 0;
+      }
+      return mask;
+    }();
+    Reg other = Permute<X>(reg);
+    return _mm256_blendv_epi8(Lo(reg, other), Hi(reg, other),
+                              Load32(kMask.data()));
+  }
+
+  // Sorts a register whose halves of 2 * D elements are bitonic
+  template <int D = kLanes / 2>
+  SORT_AVX2 static Reg Clean(Reg reg) {
+    reg = Exchange<D, D>(reg);
+    if constexpr (D > 1) {
+      return Clean<D / 2>(reg);
+    } else {
+      return reg;
+    }
+  }
+
+  // Sorted groups of W elements are merged pairwise until one is left
+  template <int W = 1>
+  SORT_AVX2 static Reg SortRegister(Reg reg) {
+    if constexpr (W < kLanes) {
+      reg = Exchange<2 * W - 1, W>(reg);
+      if constexpr (W > 1) {
+        reg = Clean<W / 2>(reg);
+      }
+      return SortRegister<2 * W>(reg);
+    } else {
+      return reg;
+    }
+  }
+
+  // Sorted `a` and `b` become the first and the second half of their merge
+  SORT_AVX2 static void MergeRegisters(Reg &a, Reg &b) {
+    b = Permute<kLanes - 1>(b);
+    Reg lo = Lo(a, b);
+    Reg hi = Hi(a, b);
+    a = Clean(lo);
+    b = Clean(hi);
+  }
+
+  // Every step merges the kept upper register with the next register of
+  // the run whose head comes first, and writes out the lower one. The run
+  // is picked by a select rather than a jump, so random data costs no
+  // branch mispredictions.
+  SORT_AVX2 static T *Merge(const T *a, const T *a_end, const T *b,
+                            const T *b_end, T *out) {
+    if (a_end - a < kLanes || b_end - b < kLanes) {
+      return std::merge(a, a_end, b, b_end, out, Before);
+    }
+
+    Reg lo = Load(a);
+    Reg hi = Load(b);
+    a += kLanes;
+    b += kLanes;
+    MergeRegisters(lo, hi);
+    Store(out, lo);
+    out += kLanes;
+
+    while (a_end - a >= kLanes && b_end - b >= kLanes) {
+      bool take_b = Before(*b, *a);
+      lo = Load(take_b ? b : a);
+      a += take_b ? 0 : kLanes;
+      b += take_b ? kLanes : 0;
+      MergeRegisters(lo, hi);
+      Store(out, lo);
+      out += kLanes;
+    }
+
+    // Three way merge of the kept register with what is left of the runs
+    alignas(32) T rest[kLanes];
+    Store(rest, hi);
+    for (const T *r = rest; r != rest + kLanes;) {
+      if (a != a_end && Before(*a, *r) && (b == b_end || !Before(*b, *a))) {
+        *out++ = *a++;
+      } else if (b != b_end && Before(*b, *r)) {
+        *out++ = *b++;
+      } else {
+        *out++ = *r++;
+      }
+    }
+    return std::merge(a, a_end, b, b_end, out, Before);
+  }
+
+  // Pairs of registers are sorted by the networks, then runs are merged
+  // bottom-up between `data` and `scratch`
+  SORT_AVX2 static void Sort(T *data, size_t size, T *scratch) {
+    constexpr size_t kBlock = 2 * kLanes;
+    size_t i = 0;
+    for (; i + kBlock <= size; i += kBlock) {
+      Reg lo = SortRegister(Load(data + i));
+      Reg hi = SortRegister(Load(data + i + kLanes));
+      MergeRegisters(lo, hi);
+      Store(data + i, lo);
+      Store(data + i + kLanes, hi);
+    }
+    std::sort(data + i, data + size, Before);
+
+    T *in = data;
+    T *out = scratch;
+    for (size_t width = kBlock; width < size; width *= 2) {
+      for (size_t lo = 0; lo < size; lo += 2 * width) {
+        size_t mid = std::min(lo + width, size);
+        size_t hi = std::min(lo + 2 * width, size);
+        Merge(in + lo, in + mid, in + mid, in + hi, out + lo);
+      }
+      std::swap(in, out);
+    }
+    if (in != data) {
+      std::copy(in, in + size, data);
+    }
+  }
+};
+
+#undef SORT_AVX2
+
+template <class Compare, class T>
+void SimdSort(T *data, size_t size, T *scratch) {
+  Avx2Kernels<T, kIsGreater<Compare, T>>::Sort(data, size, scratch);
+}
+
+template <class Compare, class T>
+T *SimdMerge(const T *first1, const T *last1, const T *first2, const T *last2,
+             T *out) {
+  return Avx2Kernels<T, kIsGreater<Compare, T>>::Merge(first1, last1, first2,
+                                                       last2, out);
+}
+
+#else
+
+inline bool SimdAvailable() { return false; }
+
+template <class Compare, class T>
+void SimdSort(T *, size_t, T *) {}
+
+template <class Compare, class T>
+T *SimdMerge(const T *, const T *, const T *, const T *, T *out) {
+  return out;
+}
+
+#endif
+
+} // namespace impl
+
+} // namespace sort
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "merge_sort.hpp"
+#include "radix_sort.hpp"
+
+#include <functional>
+#include <iterator>
+#include <type_traits>
+
+
+namespace sort {
+
+namespace impl {
+
+// Radix sort gives the same order as the comparator
+template <class Compare, class Value>
+constexpr bool kUseRadix =
+    kRadixKey<Value> && (kIsLess<Compare, Value> || kIsGreater<Compare, Value>);
+
+template <class RandomIt, class Compare>
+void Sort(RandomIt first, RandomIt last, Compare compare, ThreadPool *tp,
+          size_t threads) {
+  using Value = typename std::iterator_traits<RandomIt>::value_type;
+
+  if constexpr (kUseRadix<Compare, Value>) {
+    using Bits = decltype(OrderedBits(Value{}));
+    if constexpr (kIsLess<Compare, Value>) {
+      RadixSortBits(first, last, [](Value value) { return OrderedBits(value); },
+                    tp, threads);
+    } else {
+      RadixSortBits(first, last,
+                    [](Value value) { return static_cast<Bits>(~OrderedBits(value)); },
+                    tp, threads);
+    }
+  } else {
+    MergeSortWrapper<RandomIt, Compare> wrap(tp, threads, compare);
+    wrap.Sort(first, last);
+  }
+}
+
+} // namespace impl
+
+// Radix sort for std::less / std::greater on arithmetic types, merge sort
+// for everything else
+template <class RandomIt, class Compare>
+void Sort(RandomIt first, RandomIt last, Compare compare,
+          impl::ThreadPool &pool) {
+  impl::Sort(first, last, compare, &pool, pool.Size() + 1);
+}
+
+template <class RandomIt, class Compare>
+void Sort(RandomIt first, RandomIt last, Compare compare, size_t threads) {
+  if (threads <= 1) {
+    impl::Sort(first, last, compare, nullptr, 1);
+    return;
+  }
+
+  // one thread less because main thread already used
+  impl::ThreadPool pool(threads - 1, thread_pool::OverflowPolicy::kAllow);
+  impl::Sort(first, last, compare, &pool, threads);
+}
+
+} // namespace sort
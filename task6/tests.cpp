@@ -1,6 +1,13 @@
+#include "external_sort.hpp"
 #include "merge_sort.hpp"
+#include "sort.hpp"
 
 #include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <limits>
 
 
 int main() {
@@ -41,5 +48,222 @@ int main() {
   
   std::cout << "Case 3 completed" << std::endl;
 
+  // Case 4: one pool for many sorts, sizes around the leaf cutoffs
+  sort::impl::ThreadPool pool(3, thread_pool::OverflowPolicy::kAllow);
+  for (size_t size : {0, 1, 8191, 8192, 65537, 300000}) {
+    std::vector<int> data(size);
+    for (auto& it : data) {
+      it = rand() % 1000;
+    }
+    auto expected = data;
+    std::sort(expected.begin(), expected.end(), std::greater<int>{});
+
+    sort::MergeSort(data.begin(), data.end(), std::greater<int>{}, pool);
+    assert((data == expected));
+  }
+
+  std::cout << "Case 4 completed" << std::endl;
+
+  // Case 5: elements without default constructor
+  struct Point {
+    explicit Point(int x) : x(x) {}
+    int x;
+  };
+  std::vector<Point> points;
+  for (int i = 0; i < 100000; ++i) {
+    points.emplace_back(rand() % 1000);
+  }
+
+  sort::MergeSort(points.begin(), points.end(),
+                  [](const Point& lhs, const Point& rhs) {
+                    return lhs.x < rhs.x;
+                  },
+                  pool);
+  for (size_t i = 0; i + 1 < points.size(); ++i) {
+    assert((points[i].x <= points[i + 1].x));
+  }
+
+  std::cout << "Case 5 completed" << std::endl;
+
+  // Case 6: parallel merge keeps equal elements of the first run first
+  for (size_t size : {0, 5, 20000, 100000}) {
+    std::vector<std::pair<int, int>> left(size), right(size / 3);
+    for (auto& it : left) {
+      it = {rand() % 100, 0};
+    }
+    for (auto& it : right) {
+      it = {rand() % 100, 1};
+    }
+    auto by_key = [](const auto& lhs, const auto& rhs) {
+      return lhs.first < rhs.first;
+    };
+    std::sort(left.begin(), left.end(), by_key);
+    std::sort(right.begin(), right.end(), by_key);
+
+    std::vector<std::pair<int, int>> expected(left.size() + right.size());
+    std::vector<std::pair<int, int>> merged(expected.size());
+    std::merge(left.begin(), left.end(), right.begin(), right.end(),
+               expected.begin(), by_key);
+    sort::ParallelMerge(left.begin(), left.end(), right.begin(), right.end(),
+                        merged.begin(), by_key, pool);
+    assert((merged == expected));
+  }
+
+  std::cout << "Case 6 completed" << std::endl;
+
+  // Case 7: radix sort of signed, unsigned and float keys in both orders
+  std::vector<int> ints(200000);
+  for (auto& it : ints) {
+    it = rand() - RAND_MAX / 2;
+  }
+  auto sorted_ints = ints;
+  std::sort(sorted_ints.begin(), sorted_ints.end());
+  sort::Sort(ints.begin(), ints.end(), std::less<int>{}, pool);
+  assert((ints == sorted_ints));
+
+  std::vector<uint64_t> wide(100000);
+  for (auto& it : wide) {
+    it = (uint64_t(rand()) << 33) ^ rand();
+  }
+  auto sorted_wide = wide;
+  std::sort(sorted_wide.begin(), sorted_wide.end(), std::greater<>{});
+  sort::Sort(wide.begin(), wide.end(), std::greater<>{}, 2);
+  assert((wide == sorted_wide));
+
+  std::vector<double> reals(50000);
+  for (auto& it : reals) {
+    it = (rand() - RAND_MAX / 2) / 1000.0;
+  }
+  auto sorted_reals = reals;
+  std::sort(sorted_reals.begin(), sorted_reals.end(), std::greater<double>{});
+  sort::Sort(reals.begin(), reals.end(), std::greater<double>{}, pool);
+  assert((reals == sorted_reals));
+
+  std::cout << "Case 7 completed" << std::endl;
+
+  // Case 8: key-value pairs keep the order of equal keys
+  std::vector<std::pair<float, int>> pairs(100000);
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    pairs[i] = {static_cast<float>(rand() % 200 - 100), static_cast<int>(i)};
+  }
+  auto sorted_pairs = pairs;
+  std::stable_sort(sorted_pairs.begin(), sorted_pairs.end(),
+                   [](const auto& lhs, const auto& rhs) {
+                     return lhs.first < rhs.first;
+                   });
+  sort::RadixSort(pairs.begin(), pairs.end(),
+                  [](const auto& pair) { return pair.first; }, pool);
+  assert((pairs == sorted_pairs));
+
+  std::cout << "Case 8 completed" << std::endl;
+
+  // Case 9: a file many times larger than the memory limit is merged from
+  // runs and keeps the order of equal keys
+  struct Record {
+    uint64_t index;
+    int32_t key;
+    char payload[12];
+  };
+  std::vector<Record> records(50000);
+  for (size_t i = 0; i < records.size(); ++i) {
+    records[i] = Record{i, rand() % 1000 - 500, {}};
+  }
+  std::string input = "/tmp/external_sort_input.bin";
+  std::string output = "/tmp/external_sort_output.bin";
+  {
+    std::ofstream file(input, std::ios::binary);
+    file.write(reinterpret_cast<const char*>(records.data()),
+               records.size() * sizeof(Record));
+  }
+
+  sort::RecordFormat format{sizeof(Record), offsetof(Record, key),
+                            sort::KeyType::kInt32};
+  sort::ExternalSortOptions options{64 << 10, 4 << 10, "/tmp"};
+  sort::ExternalSort(input, output, format, options, pool);
+
+  std::stable_sort(records.begin(), records.end(),
+                   [](const Record& lhs, const Record& rhs) {
+                     return lhs.key < rhs.key;
+                   });
+  std::vector<Record> external(records.size());
+  {
+    std::ifstream file(output, std::ios::binary);
+    file.read(reinterpret_cast<char*>(external.data()),
+              external.size() * sizeof(Record));
+    assert(file.gcount() == static_cast<std::streamsize>(external.size() * sizeof(Record)));
+  }
+  for (size_t i = 0; i < records.size(); ++i) {
+    assert(external[i].index == records[i].index);
+  }
+  std::remove(input.c_str());
+  std::remove(output.c_str());
+
+  std::cout << "Case 9 completed" << std::endl;
+
+  // Case 10: vector kernels for leaves and merges, odd sizes and duplicates
+  auto check_kernels = [&](auto value, auto compare) {
+    using T = decltype(value);
+    for (size_t size : {0, 7, 33, 8191, 40000, 100003}) {
+      std::vector<T> data(size);
+      for (auto& element : data) {
+        element = static_cast<T>(rand() % (size / 4 + 1)) - static_cast<T>(size / 8);
+      }
+      auto expected = data;
+      std::sort(expected.begin(), expected.end(), compare);
+
+      auto single = data;
+      sort::MergeSort(single.begin(), single.end(), compare, 1);
+      assert(single == expected);
+      sort::MergeSort(data.begin(), data.end(), compare, pool);
+      assert(data == expected);
+    }
+  };
+  check_kernels(int32_t{}, std::less<int32_t>{});
+  check_kernels(int32_t{}, std::greater<>{});
+  check_kernels(int64_t{}, std::less<>{});
+  check_kernels(int64_t{}, std::greater<int64_t>{});
+  check_kernels(float{}, std::less<float>{});
+  check_kernels(float{}, std::greater<float>{});
+
+  // Equal floats with other bits (-0.0 and +0.0) and NaN, which is not
+  // ordered, still come out as a permutation of the input. Parallel merges
+  // split runs by binary search, which needs an order, so NaN goes through
+  // one thread only.
+  auto bits = [](std::vector<float> values) {
+    std::vector<uint32_t> res(values.size());
+    std::memcpy(res.data(), values.data(), values.size() * sizeof(float));
+    std::sort(res.begin(), res.end());
+    return res;
+  };
+  for (bool with_nan : {false, true}) {
+    std::vector<float> data(40000);
+    for (auto& element : data) {
+      int choice = rand() % 8;
+      element = choice == 0 ? -0.0f
+                : choice == 1 ? 0.0f
+                : choice == 2 && with_nan ? std::numeric_limits<float>::quiet_NaN()
+                : static_cast<float>(rand() % 7 - 3);
+    }
+
+    for (size_t threads : {1, 4}) {
+      if (with_nan && threads > 1) {
+        continue;
+      }
+      auto ascending = data;
+      sort::MergeSort(ascending.begin(), ascending.end(), std::less<float>{}, threads);
+      assert(bits(ascending) == bits(data));
+      auto descending = data;
+      sort::MergeSort(descending.begin(), descending.end(), std::greater<float>{},
+                      threads);
+      assert(bits(descending) == bits(data));
+      if (!with_nan) {
+        assert(std::is_sorted(ascending.begin(), ascending.end()));
+        assert(std::is_sorted(descending.begin(), descending.end(), std::greater<>{}));
+      }
+    }
+  }
+
+  std::cout << "Case 10 completed" << std::endl;
+
   return 0;
 }